@@ -1,8 +1,13 @@
 #pragma once
+#include "fair_scheduler.hpp"
+#include "graph_iface.hpp"
+#include "metrics_iface.hpp"
 #include "script_iface.hpp"
 #include "script_runner.hpp"
 #include "sdbus_calls_runner.hpp"
+#include "stall_detector.hpp"
 
+#include <cerrno>
 #include <memory>
 #include <vector>
 namespace scrrunner
@@ -18,30 +23,139 @@ struct AcfShellIface
     static constexpr std::string_view objPath = "/xyz/openbmc_project/acfshell";
     static constexpr std::string_view interface =
         "xyz.openbmc_project.TacfShell";
+    static constexpr size_t maxRetainedGraphs = 16;
     std::vector<std::unique_ptr<ScriptIface>> scriptIfaces;
+    std::vector<std::unique_ptr<GraphIface>> graphIfaces;
+    std::unique_ptr<MetricsIface> metricsIface;
+    StallDetector stallDetector;
+    FairScheduler scheduler{FairScheduler::Limits{}};
     AcfShellIface(net::io_context& ioc, ScriptRunner& runner,
                   std::shared_ptr<sdbusplus::asio::connection> conn) :
-        io_context(ioc), scriptRunner(runner), conn(conn), dbusServer(conn)
+        io_context(ioc), scriptRunner(runner), conn(conn), dbusServer(conn),
+        stallDetector(ioc)
     {
         conn->request_name(busName.data());
         iface = dbusServer.add_interface(objPath.data(), interface.data());
         // test generic properties
 
-        iface->register_method("active", [this]() {
-            std::vector<std::string> activeScripts;
-            for (const auto& iface : scriptIfaces)
-            {
-                activeScripts.push_back(iface->data.id);
-            }
-            return activeScripts;
-        });
+        auto& m = getMetrics();
+        iface->register_method(
+            "active", [this, &timing = m.method("active")]() {
+                metrics::ScopedTimer timer(timing);
+                std::vector<std::string> activeScripts;
+                for (const auto& iface : scriptIfaces)
+                {
+                    activeScripts.push_back(iface->data.id);
+                }
+                return activeScripts;
+            });
+        iface->register_method(
+            "queued", [this, &timing = m.method("queued")]() {
+                metrics::ScopedTimer timer(timing);
+                return scheduler.queued();
+            });
 
         iface->register_method(
-            "start", [this](const std::string& script, uint64_t timeout,
-                            bool dumpNeeded) {
-                return addToActive(script, timeout, dumpNeeded);
+            "start", [this, &timing = m.method("start")](
+                         sdbusplus::message_t& msg, const std::string& script,
+                         uint64_t timeout, bool dumpNeeded) {
+                metrics::ScopedTimer timer(timing);
+                return addToActive(msg.get_sender(), script, timeout,
+                                   dumpNeeded);
+            });
+        iface->register_method(
+            "startWith",
+            [this, &timing = m.method("startWith")](
+                sdbusplus::message_t& msg, const std::string& script,
+                uint64_t timeout, bool dumpNeeded,
+                const ScriptRunner::Options& options) {
+                metrics::ScopedTimer timer(timing);
+                auto runOptions = ScriptRunner::runOptions(options);
+                if (!runOptions)
+                {
+                    return false;
+                }
+                return addToActive(msg.get_sender(), script, timeout,
+                                   dumpNeeded, std::move(*runOptions));
+            });
+        iface->register_method(
+            "grep", [this, &timing = m.method("grep")](
+                        const std::string& id,
+                        const std::vector<std::string>& patterns,
+                        uint64_t maxMatches, uint64_t offset) {
+                metrics::ScopedTimer timer(timing);
+                return scriptRunner.grep(id, patterns, maxMatches, offset);
+            });
+        iface->register_method(
+            "read", [this, &timing = m.method("read")](
+                        const std::string& id, uint64_t offset, uint64_t len) {
+                metrics::ScopedTimer timer(timing);
+                return scriptRunner.read(id, offset, len);
+            });
+        iface->register_method(
+            "diff", [this, &timing = m.method("diff")](
+                        const std::string& base, const std::string& other) {
+                metrics::ScopedTimer timer(timing);
+                auto changed = scriptRunner.diff(base, other);
+                if (!changed)
+                {
+                    // An empty list would claim the outputs are identical
+                    throw sdbusplus::exception::SdBusError(
+                        EINVAL, "diff needs two deduplicated runs");
+                }
+                return *changed;
+            });
+        iface->register_method(
+            "register",
+            [this, &timing = m.method("register")](
+                boost::asio::yield_context yield, const std::string& name,
+                const std::string& script) {
+                metrics::ScopedTimer timer(timing);
+                return scriptRunner.register_template(yield, name, script);
+            });
+        iface->register_method(
+            "run", [this, &timing = m.method("run")](
+                       sdbusplus::message_t& msg, const std::string& name,
+                       const std::vector<std::string>& args,
+                       const ScriptRunner::Environment& env, uint64_t timeout,
+                       const ScriptRunner::Options& options) {
+                metrics::ScopedTimer timer(timing);
+                auto runOptions = ScriptRunner::runOptions(options);
+                if (!runOptions)
+                {
+                    return std::string{};
+                }
+                if (runOptions->type != ScriptRunner::ScriptType::bash)
+                {
+                    LOG_ERROR("Templates are bash scripts");
+                    return std::string{};
+                }
+                runOptions->args = args;
+                runOptions->env = env;
+                return runTemplate(msg.get_sender(), name, timeout,
+                                   std::move(*runOptions));
+            });
+        iface->register_method(
+            "startGraph",
+            [this, &timing = m.method("startGraph")](
+                sdbusplus::message_t& msg,
+                const std::vector<GraphIface::NodeSpec>& nodes, bool failFast) {
+                metrics::ScopedTimer timer(timing);
+                if (!scheduler.takeToken(msg.get_sender()))
+                {
+                    return std::string{};
+                }
+                return startGraph(msg.get_sender(), nodes, failFast);
             });
-        iface->register_method("cancel", [this](const std::string& id) {
+        iface->register_method("cancel", [this, &timing = m.method("cancel")](
+                                             const std::string& id) {
+            metrics::ScopedTimer timer(timing);
+            if (scheduler.cancel(id))
+            {
+                // It never started, so nothing else will tell its graph
+                notifyGraphs(net::error::operation_aborted, id);
+                return true;
+            }
             auto iface = getScriptIface(id);
             if (iface)
             {
@@ -50,12 +164,39 @@ struct AcfShellIface
             return false;
         });
 
+        iface->register_method(
+            "trace", [&timing = m.method("trace")](bool enable) {
+                metrics::ScopedTimer timer(timing);
+                trace::enabled().store(enable, std::memory_order_relaxed);
+                if (enable)
+                {
+                    trace::buffer().clear();
+                }
+                return true;
+            });
+        iface->register_method(
+            "dumpTrace", [&timing = m.method("dumpTrace")]() {
+                metrics::ScopedTimer timer(timing);
+                return trace::buffer().toChromeJson();
+            });
+
         iface->initialize();
+        metricsIface = std::make_unique<MetricsIface>(io_context, dbusServer,
+                                                      std::string(objPath));
     }
-    bool addToActive(const std::string& script, uint64_t timeout,
-                     bool dumpNeeded)
+    bool addToActive(const std::string& sender, const std::string& script,
+                     uint64_t timeout, bool dumpNeeded,
+                     ScriptRunner::RunOptions options = {})
     {
+        trace::Span hashSpan("hash", {}, trace::blocking);
         auto scriptId = ScriptRunner::makeHash(script);
+        if (scriptId)
+        {
+            hashSpan.tag = *scriptId;
+        }
+        hashSpan.end();
+        trace::Span span("add_to_active",
+                         scriptId ? std::string_view(*scriptId) : "");
 
         LOG_DEBUG("Starting script: {}", scriptId.value());
         if (!scriptId)
@@ -63,25 +204,193 @@ struct AcfShellIface
             LOG_ERROR("Failed to create script hash");
             return false;
         }
+        return admit(sender, *scriptId,
+                     [this, data = ScriptIface::Data{script, *scriptId, timeout,
+                                                     dumpNeeded},
+                      options = std::move(options)]() {
+                         try
+                         {
+                             auto iface = std::make_unique<ScriptIface>(
+                                 io_context, scriptRunner, data, dbusServer);
+                             return runScript(std::move(iface), options);
+                         }
+                         catch (const std::exception& e)
+                         {
+                             LOG_ERROR("Failed to create script interface: {}",
+                                       e.what());
+                             return false;
+                         }
+                     });
+    }
+    bool admit(const std::string& sender, const std::string& runId,
+               FairScheduler::Job job)
+    {
+        switch (scheduler.submit(sender, runId, std::move(job)))
+        {
+            case FairScheduler::Admission::started:
+                return true;
+            case FairScheduler::Admission::queued:
+                LOG_DEBUG("Queued run {} for {}", runId, sender);
+                return true;
+            default:
+                return false;
+        }
+    }
+    std::string runTemplate(const std::string& sender,
+                            const std::string& name, uint64_t timeout,
+                            ScriptRunner::RunOptions options)
+    {
+        auto runId =
+            scriptRunner.templateRunId(name, options.args, options.env);
+        if (!runId)
+        {
+            return std::string{};
+        }
+        LOG_DEBUG("Starting template {} as: {}", name, *runId);
+        trace::Span span("run_template", *runId);
+        bool admitted = admit(sender, *runId, [this, name, runId = *runId,
+                                               timeout,
+                                               options = std::move(options)]() {
+            try
+            {
+                auto iface = std::make_unique<ScriptIface>(
+                    io_context, scriptRunner,
+                    ScriptIface::Data{name, runId, timeout, false}, dbusServer);
+                bool success = scriptRunner.run_template(
+                    name, runId, options,
+                    std::bind_front(&AcfShellIface::onFinish, this));
+                if (!success)
+                {
+                    LOG_ERROR("Failed to start template");
+                    return false;
+                }
+                iface->startTimeout();
+                scriptIfaces.push_back(std::move(iface));
+                return true;
+            }
+            catch (const std::exception& e)
+            {
+                LOG_ERROR("Failed to create script interface: {}", e.what());
+                return false;
+            }
+        });
+        return admitted ? *runId : std::string{};
+    }
+    std::string startGraph(const std::string& sender,
+                           const std::vector<GraphIface::NodeSpec>& nodes,
+                           bool failFast)
+    {
+        auto error = GraphIface::validate(nodes);
+        if (!error.empty())
+        {
+            LOG_ERROR("Rejected graph: {}", error);
+            return std::string{};
+        }
+        // Everything that changes how the graph runs is part of its id
+        std::string key = failFast ? "failfast" : "continue";
+        for (const auto& [name, script, deps, timeout] : nodes)
+        {
+            for (const auto& field : {name, script, std::to_string(timeout)})
+            {
+                key.push_back('\0');
+                key += field;
+            }
+            for (const auto& dep : deps)
+            {
+                key.push_back('\0');
+                key += dep;
+            }
+            // Separates one node's dependency list from the next node
+            key.push_back('\1');
+        }
+        auto graphId = ScriptRunner::makeHash(key);
+        if (!graphId)
+        {
+            LOG_ERROR("Failed to create graph hash");
+            return std::string{};
+        }
+        if (std::ranges::any_of(graphIfaces, [&](const auto& graph) {
+                return graph->id == *graphId && !graph->done();
+            }))
+        {
+            LOG_ERROR("Graph {} is already running", *graphId);
+            return std::string{};
+        }
+        std::erase_if(graphIfaces, [&](const auto& graph) {
+            return graph->id == *graphId;
+        });
+        // Keep finished graphs around so clients can read the node status
+        while (graphIfaces.size() >= maxRetainedGraphs)
+        {
+            auto it = std::ranges::find_if(
+                graphIfaces, [](const auto& graph) { return graph->done(); });
+            if (it == graphIfaces.end())
+            {
+                LOG_ERROR("Too many graphs running");
+                return std::string{};
+            }
+            graphIfaces.erase(it);
+        }
+        try
+        {
+            graphIfaces.push_back(std::make_unique<GraphIface>(
+                *graphId, nodes, failFast, dbusServer,
+                [this, sender](const GraphIface::Node& node) {
+                    // Nodes share the owner's slots with its other runs
+                    ScriptIface::Data data{node.script, node.runId,
+                                           node.timeout, false};
+                    auto state = scheduler.enqueue(
+                        sender, node.runId,
+                        [this, data]() { return launchNode(data); });
+                    return state != FairScheduler::Admission::rejected;
+                },
+                [this](const std::string& runId) {
+                    if (!scheduler.cancel(runId))
+                    {
+                        scriptRunner.cancel_script(runId);
+                    }
+                }));
+        }
+        catch (const std::exception& e)
+        {
+            LOG_ERROR("Failed to create graph interface: {}", e.what());
+            return std::string{};
+        }
+        graphIfaces.back()->schedule();
+        return *graphId;
+    }
+    bool launchNode(const ScriptIface::Data& data)
+    {
+        bool started = false;
         try
         {
-            auto iface = std::make_unique<ScriptIface>(
-                io_context, scriptRunner,
-                ScriptIface::Data{script, *scriptId, timeout, dumpNeeded},
-                dbusServer);
-            return runScript(std::move(iface));
+            started = runScript(std::make_unique<ScriptIface>(
+                io_context, scriptRunner, data, dbusServer));
         }
         catch (const std::exception& e)
         {
             LOG_ERROR("Failed to create script interface: {}", e.what());
-            return false;
         }
+        if (!started)
+        {
+            // A node started from the queue has nobody to return false to,
+            // so fail it through the graph. Posted, so a node the graph
+            // launched directly is already marked failed and is ignored.
+            net::post(io_context, [this, runId = data.id]() {
+                notifyGraphs(boost::system::errc::make_error_code(
+                                 boost::system::errc::io_error),
+                             runId);
+            });
+        }
+        return started;
     }
-    bool runScript(std::unique_ptr<ScriptIface> iface)
+    bool runScript(std::unique_ptr<ScriptIface> iface,
+                   ScriptRunner::RunOptions options = {})
     {
         bool success = scriptRunner.run_script(
             iface->data.id, iface->data.script,
-            std::bind_front(&AcfShellIface::onFinish, this));
+            std::bind_front(&AcfShellIface::onFinish, this),
+            std::move(options));
         if (!success)
         {
             LOG_ERROR("Failed to start script");
@@ -117,11 +426,21 @@ struct AcfShellIface
     }
     bool onFinish(boost::system::error_code ec, std::string scriptId)
     {
-        if (!ec)
+        trace::Span span("on_finish", scriptId);
+        bool removed = removeFromActive(ec, scriptId);
+        notifyGraphs(ec, scriptId);
+        scheduler.finished(scriptId);
+        return removed;
+    }
+    void notifyGraphs(boost::system::error_code ec, const std::string& runId)
+    {
+        for (auto& graph : graphIfaces)
         {
-            return removeFromActive(ec, scriptId);
+            if (graph->onRunFinished(ec, runId))
+            {
+                break;
+            }
         }
-        return false;
     }
     bool removeFromActive(boost::system::error_code ec, std::string scriptId)
     {
@@ -0,0 +1,199 @@
+// Drains synthetic script output through a pipe the way a run does, once
+// with the per-run 4 KiB vector and std::vector match list the runner used
+// to have and once with a pooled buffer and a RunArena, and reports heap
+// allocations per run and throughput for each.
+//
+//   meson compile drain_bench && ./drain_bench [runs] [KiB per run]
+#include "buffer_pool.hpp"
+#include "line_filter.hpp"
+#include "make_awaitable_runner.hpp"
+#include "output_store.hpp"
+
+#include <unistd.h>
+
+#include <boost/asio/posix/stream_descriptor.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <format>
+#include <iostream>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace
+{
+std::atomic<size_t> allocations{0};
+// Only the draining thread is counted, not the writer
+thread_local bool counting = false;
+} // namespace
+
+[[gnu::noinline]] void* operator new(size_t size)
+{
+    if (counting)
+    {
+        allocations.fetch_add(1, std::memory_order_relaxed);
+    }
+    if (void* p = std::malloc(size == 0 ? 1 : size))
+    {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+[[gnu::noinline]] void operator delete(void* p) noexcept
+{
+    std::free(p);
+}
+[[gnu::noinline]] void operator delete(void* p, size_t) noexcept
+{
+    std::free(p);
+}
+
+namespace scrrunner
+{
+using Pipe = net::posix::stream_descriptor;
+
+// One line in 64 carries the pattern, the rest are ordinary log lines
+std::string syntheticOutput(size_t size)
+{
+    std::string out;
+    out.reserve(size + 128);
+    for (size_t line = 0; out.size() < size; ++line)
+    {
+        out += std::format("{:08} sensor={} reading={} state={}\n", line,
+                           line % 97, line * 31 % 1000,
+                           line % 64 == 0 ? "CRITICAL" : "ok");
+    }
+    out.resize(size);
+    return out;
+}
+
+// The drain loop before buffers were pooled
+net::awaitable<void> drainVector(Pipe& pipe, OutputSink& os,
+                                 LineFilter& filter)
+{
+    std::vector<char> buf(4096);
+    boost::system::error_code ec{};
+    while (!ec)
+    {
+        auto size = co_await net::async_read(
+            pipe, net::buffer(buf),
+            net::redirect_error(net::use_awaitable, ec));
+        os.write(buf.data(), size);
+        filter.feed(buf.data(), size);
+    }
+}
+// The drain loop of ScriptRunner::writeResult
+net::awaitable<void> drainPooled(Pipe& pipe, OutputSink& os,
+                                 LineFilter& filter)
+{
+    auto buf = getBufferPool().acquire();
+    boost::system::error_code ec{};
+    while (!ec)
+    {
+        auto size = co_await pipe.async_read_some(
+            net::buffer(buf.data(), buf.size()),
+            net::redirect_error(net::use_awaitable, ec));
+        os.write(buf.data(), size);
+        filter.feed(buf.data(), size);
+    }
+}
+
+template <typename Matches, typename Drain>
+net::awaitable<void> run(Pipe& pipe, const std::string& path, Matches& matches,
+                         Drain drain)
+{
+    OutputSink os(path, OutputFormat::plain);
+    LineFilter filter({"CRITICAL"},
+                      [&matches](uint64_t offset, std::string_view) {
+                          matches.push_back(offset);
+                          return true;
+                      });
+    co_await drain(pipe, os, filter);
+    filter.finish();
+    os.close();
+}
+
+struct Result
+{
+    double allocationsPerRun;
+    double mibPerSecond;
+};
+
+template <typename Body>
+Result measure(size_t runs, const std::string& output, Body body)
+{
+    net::io_context ioc;
+    std::chrono::steady_clock::duration busy{};
+    size_t total = 0;
+    for (size_t i = 0; i < runs; ++i)
+    {
+        int fds[2];
+        if (pipe(fds) != 0)
+        {
+            throw std::runtime_error("pipe failed");
+        }
+        std::jthread writer([&output, fd = fds[1]]() {
+            const char* data = output.data();
+            size_t left = output.size();
+            while (left > 0)
+            {
+                auto n = write(fd, data, left);
+                if (n <= 0)
+                {
+                    break;
+                }
+                data += n;
+                left -= n;
+            }
+            close(fd);
+        });
+        Pipe pipe(ioc, fds[0]);
+        auto start = std::chrono::steady_clock::now();
+        auto before = allocations.load();
+        counting = true;
+        net::co_spawn(ioc, body(pipe), net::detached);
+        ioc.run();
+        counting = false;
+        total += allocations.load() - before;
+        busy += std::chrono::steady_clock::now() - start;
+        ioc.restart();
+    }
+    std::chrono::duration<double> seconds = busy;
+    return Result{static_cast<double>(total) / runs,
+                  output.size() * runs / seconds.count() / (1024 * 1024)};
+}
+} // namespace scrrunner
+
+int main(int argc, char** argv)
+{
+    using namespace scrrunner;
+    size_t runs = argc > 1 ? std::stoul(argv[1]) : 200;
+    size_t kib = argc > 2 ? std::stoul(argv[2]) : 1024;
+    auto output = syntheticOutput(kib * 1024);
+    std::string path = std::format("/tmp/drain_bench.{}.out", getpid());
+
+    auto vector = measure(runs, output, [&path](Pipe& pipe) {
+        return [](Pipe& pipe, const std::string& path) -> net::awaitable<void> {
+            std::vector<uint64_t> matches;
+            co_await run(pipe, path, matches, drainVector);
+        }(pipe, path);
+    });
+    auto pooled = measure(runs, output, [&path](Pipe& pipe) {
+        return [](Pipe& pipe, const std::string& path) -> net::awaitable<void> {
+            RunArena arena;
+            std::pmr::vector<uint64_t> matches(arena.get());
+            co_await run(pipe, path, matches, drainPooled);
+        }(pipe, path);
+    });
+    std::filesystem::remove(path);
+
+    std::cout << std::format("{} runs of {} KiB\n", runs, kib);
+    std::cout << std::format("vector: {:.1f} allocations/run, {:.0f} MiB/s\n",
+                             vector.allocationsPerRun, vector.mibPerSecond);
+    std::cout << std::format("pooled: {:.1f} allocations/run, {:.0f} MiB/s\n",
+                             pooled.allocationsPerRun, pooled.mibPerSecond);
+    return 0;
+}
@@ -0,0 +1,87 @@
+#pragma once
+#include <array>
+#include <cstddef>
+#include <memory>
+#include <memory_resource>
+#include <vector>
+namespace scrrunner
+{
+// Reusable I/O buffers sized to a full pipe, so draining a run never
+// allocates once the pool is warm. Only used from the io thread, hence no
+// locking.
+struct BufferPool
+{
+    static constexpr size_t bufferSize = 64 * 1024;
+    static constexpr size_t maxIdle = 16;
+    struct Lease
+    {
+        Lease(BufferPool& pool, std::unique_ptr<char[]> buf) :
+            pool(&pool), buf(std::move(buf))
+        {}
+        Lease(Lease&&) = default;
+        Lease& operator=(Lease&&) = delete;
+        ~Lease()
+        {
+            if (buf)
+            {
+                pool->release(std::move(buf));
+            }
+        }
+        char* data() const
+        {
+            return buf.get();
+        }
+        static constexpr size_t size()
+        {
+            return bufferSize;
+        }
+        BufferPool* pool;
+        std::unique_ptr<char[]> buf;
+    };
+    Lease acquire()
+    {
+        if (idle.empty())
+        {
+            return Lease(*this, std::make_unique_for_overwrite<char[]>(
+                                    bufferSize));
+        }
+        auto buf = std::move(idle.back());
+        idle.pop_back();
+        return Lease(*this, std::move(buf));
+    }
+    void release(std::unique_ptr<char[]> buf)
+    {
+        if (idle.size() < maxIdle)
+        {
+            idle.push_back(std::move(buf));
+        }
+    }
+    std::vector<std::unique_ptr<char[]>> idle;
+};
+inline BufferPool& getBufferPool()
+{
+    static BufferPool pool;
+    return pool;
+}
+// Chunks recycled between runs' arenas
+inline std::pmr::memory_resource* arenaUpstream()
+{
+    static std::pmr::unsynchronized_pool_resource upstream;
+    return &upstream;
+}
+// Bump allocator for one run's match offsets. Nothing is freed
+// individually; everything goes back at once when the run ends.
+struct RunArena
+{
+    RunArena() = default;
+    RunArena(const RunArena&) = delete;
+    RunArena& operator=(const RunArena&) = delete;
+    std::pmr::memory_resource* get()
+    {
+        return &resource;
+    }
+    std::array<std::byte, 1024> initial;
+    std::pmr::monotonic_buffer_resource resource{initial.data(), initial.size(),
+                                                 arenaUpstream()};
+};
+} // namespace scrrunner
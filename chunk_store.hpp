@@ -0,0 +1,385 @@
+#pragma once
+#include "logger.hpp"
+
+#include <openssl/evp.h>
+#include <zlib.h>
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_set>
+#include <vector>
+namespace scrrunner
+{
+// Deduplicated output: content is cut into chunks at positions chosen by a
+// rolling hash, so an insertion only disturbs the chunks around it. Each
+// unique chunk is stored once, zlib packed, under chunkDirectory and a run
+// is kept as <id>.out.manifest listing its chunks in order. The previous
+// historyDepth manifests of an id are kept as <id>.out.manifest.<n>.
+namespace chunks
+{
+constexpr auto chunkDirectory = "/tmp/acf/chunks";
+constexpr size_t minSize = 2 * 1024;
+constexpr size_t maxSize = 64 * 1024;
+// Cut where the low 13 bits are zero: about 8 KiB past minSize on average
+constexpr uint64_t cutMask = (uint64_t{1} << 13) - 1;
+constexpr size_t historyDepth = 8;
+constexpr auto sweepInterval = std::chrono::minutes(5);
+constexpr int level = 3;
+
+// Gear hash table, filled by splitmix64 so it is fixed across builds
+constexpr std::array<uint64_t, 256> gear = [] {
+    std::array<uint64_t, 256> table{};
+    uint64_t state = 0x6163667368656c6cULL;
+    for (auto& entry : table)
+    {
+        uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        entry = z ^ (z >> 31);
+    }
+    return table;
+}();
+
+struct ChunkRef
+{
+    std::string hash;
+    uint32_t size;
+};
+using Manifest = std::vector<ChunkRef>;
+
+// 128 bits of SHA-256, as hex
+inline std::string digest(std::string_view data)
+{
+    unsigned char md[EVP_MAX_MD_SIZE];
+    unsigned int mdLen = 0;
+    if (EVP_Digest(data.data(), data.size(), md, &mdLen, EVP_sha256(),
+                   nullptr) != 1)
+    {
+        LOG_ERROR("Failed to compute chunk digest");
+        return {};
+    }
+    static constexpr char hex[] = "0123456789abcdef";
+    std::string result;
+    result.reserve(32);
+    for (unsigned int i = 0; i < 16 && i < mdLen; ++i)
+    {
+        result.push_back(hex[md[i] >> 4]);
+        result.push_back(hex[md[i] & 0xf]);
+    }
+    return result;
+}
+inline std::string chunkPath(std::string_view hash)
+{
+    std::string path(chunkDirectory);
+    path.append("/").append(hash.substr(0, 2)).append("/").append(hash);
+    return path;
+}
+inline std::string manifestPath(const std::string& outputPath,
+                                size_t generation = 0)
+{
+    std::string path = outputPath + ".manifest";
+    if (generation > 0)
+    {
+        path += "." + std::to_string(generation);
+    }
+    return path;
+}
+inline std::optional<Manifest> loadManifest(const std::string& path)
+{
+    std::ifstream ifs(path);
+    if (!ifs)
+    {
+        return std::nullopt;
+    }
+    Manifest manifest;
+    ChunkRef ref;
+    while (ifs >> ref.hash >> ref.size)
+    {
+        manifest.push_back(ref);
+    }
+    return manifest;
+}
+// Shift <path>.manifest into <path>.manifest.1, .1 into .2 and so on,
+// dropping the oldest
+inline void rotateManifests(const std::string& outputPath)
+{
+    std::error_code ec;
+    for (size_t n = historyDepth; n > 0; --n)
+    {
+        auto from = manifestPath(outputPath, n - 1);
+        if (std::filesystem::exists(from, ec))
+        {
+            std::filesystem::rename(from, manifestPath(outputPath, n), ec);
+        }
+    }
+}
+// Finds content-defined cut points in a byte stream
+struct Chunker
+{
+    using OnChunk = std::function<void(std::string_view)>;
+    explicit Chunker(OnChunk onChunk) : onChunk(std::move(onChunk))
+    {
+        pending.reserve(maxSize);
+    }
+    void write(const char* buf, size_t size)
+    {
+        while (size > 0)
+        {
+            bool cut = false;
+            size_t n = scan(buf, size, cut);
+            pending.insert(pending.end(), buf, buf + n);
+            buf += n;
+            size -= n;
+            if (cut)
+            {
+                emit();
+            }
+        }
+    }
+    void finish()
+    {
+        if (!pending.empty())
+        {
+            emit();
+        }
+    }
+    // Bytes of buf that belong to the current chunk
+    size_t scan(const char* buf, size_t size, bool& cut)
+    {
+        for (size_t i = 0; i < size; ++i)
+        {
+            hash = (hash << 1) + gear[static_cast<unsigned char>(buf[i])];
+            size_t length = pending.size() + i + 1;
+            if ((length >= minSize && (hash & cutMask) == 0) ||
+                length == maxSize)
+            {
+                cut = true;
+                return i + 1;
+            }
+        }
+        return size;
+    }
+    void emit()
+    {
+        onChunk(std::string_view(pending.data(), pending.size()));
+        pending.clear();
+        hash = 0;
+    }
+    OnChunk onChunk;
+    std::vector<char> pending;
+    uint64_t hash = 0;
+};
+// Stores a run's output as chunks, appending to the manifest as it goes so
+// a run in progress can already be read
+struct ChunkWriter
+{
+    explicit ChunkWriter(const std::string& outputPath) :
+        chunker([this](std::string_view chunk) { store(chunk); })
+    {
+        rotateManifests(outputPath);
+        manifest.open(manifestPath(outputPath), std::ios::trunc);
+    }
+    explicit operator bool() const
+    {
+        return static_cast<bool>(manifest);
+    }
+    void write(const char* buf, size_t size)
+    {
+        chunker.write(buf, size);
+    }
+    void close()
+    {
+        chunker.finish();
+        manifest.close();
+    }
+    void store(std::string_view chunk)
+    {
+        auto hash = digest(chunk);
+        if (hash.empty())
+        {
+            return;
+        }
+        auto path = chunkPath(hash);
+        std::error_code ec;
+        if (!std::filesystem::exists(path, ec) && !persist(path, chunk))
+        {
+            return;
+        }
+        manifest << hash << ' ' << chunk.size() << '\n';
+        manifest.flush();
+    }
+    bool persist(const std::string& path, std::string_view chunk)
+    {
+        uLongf packedSize = compressBound(chunk.size());
+        packed.resize(packedSize);
+        if (compress2(packed.data(), &packedSize,
+                      reinterpret_cast<const Bytef*>(chunk.data()),
+                      chunk.size(), level) != Z_OK)
+        {
+            LOG_ERROR("Failed to compress chunk");
+            return false;
+        }
+        std::error_code ec;
+        std::filesystem::create_directories(
+            std::filesystem::path(path).parent_path(), ec);
+        // Never expose a partially written chunk under its final name
+        auto tmp = path + ".tmp";
+        std::ofstream ofs(tmp, std::ios::binary | std::ios::trunc);
+        ofs.write(reinterpret_cast<const char*>(packed.data()),
+                  static_cast<std::streamsize>(packedSize));
+        ofs.close();
+        if (!ofs)
+        {
+            LOG_ERROR("Failed to write chunk {}", path);
+            std::filesystem::remove(tmp, ec);
+            return false;
+        }
+        std::filesystem::rename(tmp, path, ec);
+        return !ec;
+    }
+    Chunker chunker;
+    std::ofstream manifest;
+    std::vector<Bytef> packed;
+};
+struct ChunkReader
+{
+    explicit ChunkReader(const std::string& manifestFile)
+    {
+        auto loaded = loadManifest(manifestFile);
+        if (!loaded)
+        {
+            return;
+        }
+        manifest = std::move(*loaded);
+        offsets.reserve(manifest.size());
+        uint64_t offset = 0;
+        for (const auto& ref : manifest)
+        {
+            offsets.push_back(offset);
+            offset += ref.size;
+        }
+        valid = true;
+    }
+    explicit operator bool() const
+    {
+        return valid;
+    }
+    // Inflate the chunk holding rawOffset, reusing the last one if possible
+    std::optional<size_t> load(uint64_t rawOffset)
+    {
+        auto it = std::ranges::upper_bound(offsets, rawOffset);
+        if (it == offsets.begin())
+        {
+            return std::nullopt;
+        }
+        size_t index = std::distance(offsets.begin(), it) - 1;
+        if (rawOffset >= offsets[index] + manifest[index].size)
+        {
+            return std::nullopt;
+        }
+        if (current == index)
+        {
+            return current;
+        }
+        current.reset();
+        std::ifstream ifs(chunkPath(manifest[index].hash), std::ios::binary);
+        std::vector<Bytef> packed((std::istreambuf_iterator<char>(ifs)),
+                                  std::istreambuf_iterator<char>());
+        raw.resize(manifest[index].size);
+        uLongf rawSize = raw.size();
+        if (packed.empty() ||
+            uncompress(reinterpret_cast<Bytef*>(raw.data()), &rawSize,
+                       packed.data(), packed.size()) != Z_OK ||
+            rawSize != raw.size())
+        {
+            LOG_ERROR("Failed to load chunk {}", manifest[index].hash);
+            return std::nullopt;
+        }
+        current = index;
+        return current;
+    }
+    size_t read(uint64_t offset, char* buf, size_t len)
+    {
+        size_t copied = 0;
+        while (copied < len)
+        {
+            auto index = load(offset + copied);
+            if (!index)
+            {
+                break;
+            }
+            size_t start = offset + copied - offsets[*index];
+            size_t n = std::min<size_t>(len - copied,
+                                        manifest[*index].size - start);
+            std::memcpy(buf + copied, raw.data() + start, n);
+            copied += n;
+        }
+        return copied;
+    }
+    Manifest manifest;
+    std::vector<uint64_t> offsets;
+    std::vector<char> raw;
+    std::optional<size_t> current;
+    bool valid = false;
+};
+// Remove chunks that no manifest under root refers to any more. Writers
+// add a chunk to their manifest as soon as it is stored, so this is safe
+// between any two io thread handlers.
+inline void sweep(const std::string& root)
+{
+    namespace fs = std::filesystem;
+    std::error_code ec;
+    std::unordered_set<std::string> live;
+    for (const auto& dir : fs::directory_iterator(root, ec))
+    {
+        if (!dir.is_directory(ec) || dir.path() == chunkDirectory)
+        {
+            continue;
+        }
+        for (const auto& file : fs::directory_iterator(dir.path(), ec))
+        {
+            if (file.path().filename().string().find(".manifest") ==
+                std::string::npos)
+            {
+                continue;
+            }
+            if (auto manifest = loadManifest(file.path().string()))
+            {
+                for (auto& ref : *manifest)
+                {
+                    live.insert(std::move(ref.hash));
+                }
+            }
+        }
+    }
+    std::vector<fs::path> dead;
+    for (const auto& file : fs::recursive_directory_iterator(chunkDirectory,
+                                                             ec))
+    {
+        if (file.is_regular_file(ec) &&
+            !live.contains(file.path().filename().string()))
+        {
+            dead.push_back(file.path());
+        }
+    }
+    for (const auto& path : dead)
+    {
+        fs::remove(path, ec);
+    }
+    if (!dead.empty())
+    {
+        LOG_DEBUG("Removed {} unreferenced output chunks", dead.size());
+    }
+}
+} // namespace chunks
+} // namespace scrrunner
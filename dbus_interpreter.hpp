@@ -0,0 +1,1078 @@
+#pragma once
+#include "logger.hpp"
+#include "sdbus_calls_runner.hpp"
+#include "trace.hpp"
+
+#include <systemd/sd-bus.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <format>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <vector>
+namespace scrrunner
+{
+// Runs scripts made of busctl command lines over the daemon's own bus
+// connection instead of forking busctl per line. Supported verbs are
+// get-property, set-property, call, tree and introspect, with busctl's
+// argument syntax and output format. Options that would change what
+// busctl does and are not implemented here fail the command instead of
+// being ignored. Read-only commands between two mutating ones (call,
+// set-property) are issued concurrently; output is always written in
+// script order.
+struct DbusInterpreter
+{
+    static constexpr size_t maxInFlight = 32;
+    // Longer property values are cut in the introspect table unless -l
+    static constexpr size_t valueWidth = 60;
+    struct Command
+    {
+        size_t line;
+        std::vector<std::string> argv;
+        std::vector<std::string> options;
+        bool has(std::string_view option) const
+        {
+            return std::ranges::find(options, option) != options.end();
+        }
+    };
+    // One row of busctl's introspect table
+    struct Member
+    {
+        std::string interface;
+        std::string type;
+        std::string name;
+        std::string signature;
+        std::string result;
+        std::optional<std::string> value;
+        std::string_view change;
+        bool writable = false;
+        bool deprecated = false;
+        bool noReply = false;
+    };
+    struct Result
+    {
+        bool ok = true;
+        std::string output;
+        sdbusplus::message_t reply{};
+    };
+    // runId tags this run's trace spans
+    DbusInterpreter(sdbusplus::asio::connection& conn, std::string runId) :
+        conn(conn), runId(std::move(runId))
+    {}
+
+    // Shell style word splitting with '...', "..." and backslash escapes
+    static std::vector<std::string> tokenize(std::string_view line)
+    {
+        std::vector<std::string> words;
+        std::string word;
+        bool inWord = false;
+        char quote = 0;
+        for (size_t i = 0; i < line.size(); ++i)
+        {
+            char c = line[i];
+            if (quote == 0 && (c == ' ' || c == '\t'))
+            {
+                if (inWord)
+                {
+                    words.push_back(std::move(word));
+                    word.clear();
+                    inWord = false;
+                }
+                continue;
+            }
+            if (quote == 0 && c == '#' && !inWord)
+            {
+                break;
+            }
+            inWord = true;
+            if (c == '\\' && quote != '\'' && i + 1 < line.size())
+            {
+                word.push_back(line[++i]);
+            }
+            else if (quote == 0 && (c == '\'' || c == '"'))
+            {
+                quote = c;
+            }
+            else if (c == quote)
+            {
+                quote = 0;
+            }
+            else
+            {
+                word.push_back(c);
+            }
+        }
+        if (inWord)
+        {
+            words.push_back(std::move(word));
+        }
+        return words;
+    }
+    static std::vector<Command> parse(std::string_view script)
+    {
+        std::vector<Command> commands;
+        size_t lineNo = 0;
+        while (!script.empty())
+        {
+            auto nl = script.find('\n');
+            auto line = script.substr(0, nl);
+            script.remove_prefix(nl == std::string_view::npos ? script.size()
+                                                              : nl + 1);
+            ++lineNo;
+            auto words = tokenize(line);
+            if (!words.empty() && words.front() == "busctl")
+            {
+                words.erase(words.begin());
+            }
+            Command command{lineNo, {}, {}};
+            bool optionsDone = false;
+            for (auto& word : words)
+            {
+                // Like getopt: options may appear anywhere until "--".
+                // After the verb "-5" is a value, not an option.
+                bool option = !optionsDone && word.size() > 1 &&
+                              word.starts_with('-') &&
+                              (command.argv.empty() || word[1] == '-' ||
+                               !std::isdigit(static_cast<unsigned char>(
+                                   word[1])));
+                if (option && word == "--")
+                {
+                    optionsDone = true;
+                }
+                else if (option)
+                {
+                    command.options.push_back(std::move(word));
+                }
+                else
+                {
+                    command.argv.push_back(std::move(word));
+                }
+            }
+            if (!command.argv.empty())
+            {
+                commands.push_back(std::move(command));
+            }
+        }
+        return commands;
+    }
+    // Options that match what the interpreter does anyway, or that it
+    // implements. Anything else, such as --user or --timeout, would make
+    // the result differ from busctl's.
+    static bool isSupportedOption(std::string_view option)
+    {
+        return option == "--no-pager" || option == "--no-legend" ||
+               option == "--system" || option == "--xml-interface" ||
+               option == "-l" || option == "--full";
+    }
+    static bool isBarrier(const Command& command)
+    {
+        return command.argv[0] == "call" || command.argv[0] == "set-property";
+    }
+
+    static std::string quote(std::string_view str)
+    {
+        std::string out = "\"";
+        for (char c : str)
+        {
+            switch (c)
+            {
+                case '"':
+                    out += "\\\"";
+                    break;
+                case '\\':
+                    out += "\\\\";
+                    break;
+                case '\n':
+                    out += "\\n";
+                    break;
+                case '\t':
+                    out += "\\t";
+                    break;
+                default:
+                    if (static_cast<unsigned char>(c) < 0x20)
+                    {
+                        out += std::format("\\x{:02x}",
+                                           static_cast<unsigned char>(c));
+                    }
+                    else
+                    {
+                        out.push_back(c);
+                    }
+            }
+        }
+        out.push_back('"');
+        return out;
+    }
+    static void check(int r, std::string_view what)
+    {
+        if (r < 0)
+        {
+            throw std::runtime_error(std::format("Failed to {}: {}", what,
+                                                 std::strerror(-r)));
+        }
+    }
+    // Formats one complete value the way busctl prints it. Returns false
+    // when the current container has no more values.
+    static bool formatValue(sd_bus_message* m, std::vector<std::string>& out)
+    {
+        char type = 0;
+        const char* contents = nullptr;
+        int r = sd_bus_message_peek_type(m, &type, &contents);
+        check(r, "read reply");
+        if (r == 0)
+        {
+            return false;
+        }
+        switch (type)
+        {
+            case SD_BUS_TYPE_ARRAY:
+            {
+                check(sd_bus_message_enter_container(m, type, contents),
+                      "enter array");
+                size_t countAt = out.size();
+                out.emplace_back();
+                size_t count = 0;
+                while (formatValue(m, out))
+                {
+                    ++count;
+                }
+                out[countAt] = std::to_string(count);
+                check(sd_bus_message_exit_container(m), "exit array");
+                return true;
+            }
+            case SD_BUS_TYPE_VARIANT:
+                check(sd_bus_message_enter_container(m, type, contents),
+                      "enter variant");
+                out.emplace_back(contents);
+                formatValue(m, out);
+                check(sd_bus_message_exit_container(m), "exit variant");
+                return true;
+            case SD_BUS_TYPE_STRUCT:
+            case SD_BUS_TYPE_DICT_ENTRY:
+                check(sd_bus_message_enter_container(m, type, contents),
+                      "enter container");
+                while (formatValue(m, out))
+                {}
+                check(sd_bus_message_exit_container(m), "exit container");
+                return true;
+            default:
+                break;
+        }
+        union
+        {
+            uint8_t u8;
+            int b;
+            int16_t s16;
+            uint16_t u16;
+            int32_t s32;
+            uint32_t u32;
+            int64_t s64;
+            uint64_t u64;
+            double d;
+            const char* str;
+        } v{};
+        check(sd_bus_message_read_basic(m, type, &v), "read value");
+        switch (type)
+        {
+            case SD_BUS_TYPE_BYTE:
+                out.push_back(std::to_string(v.u8));
+                break;
+            case SD_BUS_TYPE_BOOLEAN:
+                out.emplace_back(v.b ? "true" : "false");
+                break;
+            case SD_BUS_TYPE_INT16:
+                out.push_back(std::to_string(v.s16));
+                break;
+            case SD_BUS_TYPE_UINT16:
+                out.push_back(std::to_string(v.u16));
+                break;
+            case SD_BUS_TYPE_INT32:
+                out.push_back(std::to_string(v.s32));
+                break;
+            case SD_BUS_TYPE_UINT32:
+            case SD_BUS_TYPE_UNIX_FD:
+                out.push_back(std::to_string(v.u32));
+                break;
+            case SD_BUS_TYPE_INT64:
+                out.push_back(std::to_string(v.s64));
+                break;
+            case SD_BUS_TYPE_UINT64:
+                out.push_back(std::to_string(v.u64));
+                break;
+            case SD_BUS_TYPE_DOUBLE:
+            {
+                char buf[32];
+                std::snprintf(buf, sizeof(buf), "%g", v.d);
+                out.emplace_back(buf);
+                break;
+            }
+            default:
+                out.push_back(quote(v.str));
+        }
+        return true;
+    }
+    static std::string join(const std::vector<std::string>& words)
+    {
+        std::string line;
+        for (const auto& word : words)
+        {
+            if (!line.empty())
+            {
+                line.push_back(' ');
+            }
+            line += word;
+        }
+        return line;
+    }
+
+    // Length of the complete type starting at sig[pos]
+    static size_t typeLength(std::string_view sig, size_t pos)
+    {
+        if (pos >= sig.size())
+        {
+            throw std::invalid_argument("Truncated signature");
+        }
+        char c = sig[pos];
+        if (c == SD_BUS_TYPE_ARRAY)
+        {
+            return 1 + typeLength(sig, pos + 1);
+        }
+        if (c == SD_BUS_TYPE_STRUCT_BEGIN || c == SD_BUS_TYPE_DICT_ENTRY_BEGIN)
+        {
+            char close = c == SD_BUS_TYPE_STRUCT_BEGIN
+                             ? SD_BUS_TYPE_STRUCT_END
+                             : SD_BUS_TYPE_DICT_ENTRY_END;
+            size_t end = pos + 1;
+            while (end < sig.size() && sig[end] != close)
+            {
+                end += typeLength(sig, end);
+            }
+            if (end >= sig.size())
+            {
+                throw std::invalid_argument("Unbalanced signature");
+            }
+            return end + 1 - pos;
+        }
+        return 1;
+    }
+    static const std::string& next(const std::vector<std::string>& args,
+                                   size_t& ai)
+    {
+        if (ai >= args.size())
+        {
+            throw std::invalid_argument("Too few parameters for signature");
+        }
+        return args[ai++];
+    }
+    // Appends busctl style parameters for one complete type
+    static void appendValue(sd_bus_message* m, std::string_view type,
+                            const std::vector<std::string>& args, size_t& ai)
+    {
+        char c = type[0];
+        if (c == SD_BUS_TYPE_ARRAY)
+        {
+            std::string element(type.substr(1));
+            size_t count = std::stoul(next(args, ai));
+            check(sd_bus_message_open_container(m, c, element.c_str()),
+                  "open array");
+            for (size_t i = 0; i < count; ++i)
+            {
+                appendValue(m, element, args, ai);
+            }
+            check(sd_bus_message_close_container(m), "close array");
+            return;
+        }
+        if (c == SD_BUS_TYPE_VARIANT)
+        {
+            std::string inner = next(args, ai);
+            if (inner.empty() || typeLength(inner, 0) != inner.size())
+            {
+                throw std::invalid_argument("Bad variant signature");
+            }
+            check(sd_bus_message_open_container(m, c, inner.c_str()),
+                  "open variant");
+            appendValue(m, inner, args, ai);
+            check(sd_bus_message_close_container(m), "close variant");
+            return;
+        }
+        if (c == SD_BUS_TYPE_STRUCT_BEGIN || c == SD_BUS_TYPE_DICT_ENTRY_BEGIN)
+        {
+            std::string inner(type.substr(1, type.size() - 2));
+            check(sd_bus_message_open_container(
+                      m,
+                      c == SD_BUS_TYPE_STRUCT_BEGIN ? SD_BUS_TYPE_STRUCT
+                                                    : SD_BUS_TYPE_DICT_ENTRY,
+                      inner.c_str()),
+                  "open container");
+            appendSignature(m, inner, args, ai);
+            check(sd_bus_message_close_container(m), "close container");
+            return;
+        }
+        const std::string& arg = next(args, ai);
+        union
+        {
+            uint8_t u8;
+            int b;
+            int16_t s16;
+            uint16_t u16;
+            int32_t s32;
+            uint32_t u32;
+            int64_t s64;
+            uint64_t u64;
+            double d;
+        } v{};
+        const void* p = &v;
+        switch (c)
+        {
+            case SD_BUS_TYPE_BYTE:
+                v.u8 = static_cast<uint8_t>(std::stoul(arg));
+                break;
+            case SD_BUS_TYPE_BOOLEAN:
+                v.b = arg == "true" || arg == "yes" || arg == "1";
+                break;
+            case SD_BUS_TYPE_INT16:
+                v.s16 = static_cast<int16_t>(std::stol(arg));
+                break;
+            case SD_BUS_TYPE_UINT16:
+                v.u16 = static_cast<uint16_t>(std::stoul(arg));
+                break;
+            case SD_BUS_TYPE_INT32:
+                v.s32 = static_cast<int32_t>(std::stol(arg));
+                break;
+            case SD_BUS_TYPE_UINT32:
+                v.u32 = static_cast<uint32_t>(std::stoul(arg));
+                break;
+            case SD_BUS_TYPE_INT64:
+                v.s64 = std::stoll(arg);
+                break;
+            case SD_BUS_TYPE_UINT64:
+                v.u64 = std::stoull(arg);
+                break;
+            case SD_BUS_TYPE_DOUBLE:
+                v.d = std::stod(arg);
+                break;
+            case SD_BUS_TYPE_STRING:
+            case SD_BUS_TYPE_OBJECT_PATH:
+            case SD_BUS_TYPE_SIGNATURE:
+                p = arg.c_str();
+                break;
+            default:
+                throw std::invalid_argument(
+                    std::format("Unsupported type '{}'", c));
+        }
+        check(sd_bus_message_append_basic(m, c, p), "append parameter");
+    }
+    static void appendSignature(sd_bus_message* m, std::string_view sig,
+                                const std::vector<std::string>& args,
+                                size_t& ai)
+    {
+        for (size_t pos = 0; pos < sig.size();)
+        {
+            size_t len = typeLength(sig, pos);
+            appendValue(m, sig.substr(pos, len), args, ai);
+            pos += len;
+        }
+    }
+
+    net::awaitable<Result> send(sdbusplus::message_t& msg,
+                                std::string_view failure)
+    {
+        auto [ec, reply] = co_await awaitable_dbus_send(conn, msg);
+        if (ec)
+        {
+            const sd_bus_error* error = sd_bus_message_get_error(reply.get());
+            co_return Result{false,
+                             std::format("{}: {}\n", failure,
+                                         error != nullptr &&
+                                                 error->message != nullptr
+                                             ? error->message
+                                             : ec.message())};
+        }
+        co_return Result{true, {}, std::move(reply)};
+    }
+    net::awaitable<Result> getProperty(const std::vector<std::string>& argv)
+    {
+        if (argv.size() < 5)
+        {
+            co_return Result{false, "get-property: SERVICE OBJECT INTERFACE "
+                                    "PROPERTY... expected\n"};
+        }
+        Result result;
+        for (size_t i = 4; i < argv.size(); ++i)
+        {
+            auto msg = conn.new_method_call(
+                argv[1].c_str(), argv[2].c_str(),
+                "org.freedesktop.DBus.Properties", "Get");
+            msg.append(argv[3], argv[i]);
+            auto reply = co_await send(
+                msg, std::format("Failed to get property {} on interface {}",
+                                 argv[i], argv[3]));
+            if (!reply.ok)
+            {
+                result.ok = false;
+                result.output += reply.output;
+                continue;
+            }
+            std::vector<std::string> words;
+            formatValue(reply.reply.get(), words);
+            result.output += join(words) + "\n";
+        }
+        co_return result;
+    }
+    net::awaitable<Result> setProperty(const std::vector<std::string>& argv)
+    {
+        if (argv.size() < 7)
+        {
+            co_return Result{false, "set-property: SERVICE OBJECT INTERFACE "
+                                    "PROPERTY SIGNATURE ARGUMENT... "
+                                    "expected\n"};
+        }
+        auto msg = conn.new_method_call(argv[1].c_str(), argv[2].c_str(),
+                                        "org.freedesktop.DBus.Properties",
+                                        "Set");
+        msg.append(argv[3], argv[4]);
+        // Reuse the variant path: the signature is the first parameter
+        size_t ai = 5;
+        appendValue(msg.get(), "v", argv, ai);
+        auto reply = co_await send(
+            msg, std::format("Failed to set property {} on interface {}",
+                             argv[4], argv[3]));
+        reply.output.clear();
+        co_return reply.ok ? Result{} : reply;
+    }
+    net::awaitable<Result> call(const std::vector<std::string>& argv)
+    {
+        if (argv.size() < 5)
+        {
+            co_return Result{false, "call: SERVICE OBJECT INTERFACE METHOD "
+                                    "[SIGNATURE [ARGUMENT...]] expected\n"};
+        }
+        auto msg = conn.new_method_call(argv[1].c_str(), argv[2].c_str(),
+                                        argv[3].c_str(), argv[4].c_str());
+        if (argv.size() > 5)
+        {
+            size_t ai = 6;
+            appendSignature(msg.get(), argv[5], argv, ai);
+            if (ai != argv.size())
+            {
+                throw std::invalid_argument(
+                    "Too many parameters for signature");
+            }
+        }
+        auto reply = co_await send(msg, "Call failed");
+        if (!reply.ok)
+        {
+            co_return reply;
+        }
+        std::string sig = sd_bus_message_get_signature(reply.reply.get(), 1);
+        if (sig.empty())
+        {
+            co_return Result{};
+        }
+        std::vector<std::string> words{sig};
+        while (formatValue(reply.reply.get(), words))
+        {}
+        co_return Result{true, join(words) + "\n"};
+    }
+    static std::vector<std::string> childNodes(std::string_view xml)
+    {
+        std::vector<std::string> children;
+        constexpr std::string_view tag = "<node name=\"";
+        for (auto pos = xml.find(tag); pos != std::string_view::npos;
+             pos = xml.find(tag, pos))
+        {
+            pos += tag.size();
+            auto end = xml.find('"', pos);
+            if (end == std::string_view::npos)
+            {
+                break;
+            }
+            children.emplace_back(xml.substr(pos, end - pos));
+        }
+        return children;
+    }
+    static std::string attribute(std::string_view tag, std::string_view key)
+    {
+        for (size_t pos = tag.find(key); pos != std::string_view::npos;
+             pos = tag.find(key, pos + 1))
+        {
+            size_t quoteAt = pos + key.size() + 1;
+            if (pos == 0 || !std::isspace(static_cast<unsigned char>(
+                                tag[pos - 1])) ||
+                tag.substr(pos + key.size()).substr(0, 2) != "=\"")
+            {
+                continue;
+            }
+            size_t end = tag.find('"', quoteAt + 1);
+            if (end == std::string_view::npos)
+            {
+                break;
+            }
+            return std::string(tag.substr(quoteAt + 1, end - quoteAt - 1));
+        }
+        return {};
+    }
+    // Flattens introspection XML into busctl's introspect rows, sorted the
+    // way busctl sorts them
+    static std::vector<Member> parseIntrospection(std::string_view xml)
+    {
+        std::vector<Member> members;
+        std::string interface;
+        std::string_view interfaceChange = "emits-change";
+        std::optional<size_t> current;
+        size_t pos = 0;
+        while ((pos = xml.find('<', pos)) != std::string_view::npos)
+        {
+            if (xml.substr(pos, 4) == "<!--")
+            {
+                pos = xml.find("-->", pos);
+                continue;
+            }
+            auto end = xml.find('>', pos);
+            if (end == std::string_view::npos)
+            {
+                break;
+            }
+            auto tag = xml.substr(pos + 1, end - pos - 1);
+            pos = end + 1;
+            if (tag.empty() || tag[0] == '!' || tag[0] == '?')
+            {
+                continue;
+            }
+            bool closing = tag[0] == '/';
+            bool selfClosing = tag.back() == '/';
+            auto element = tag.substr(closing ? 1 : 0);
+            element = element.substr(0, element.find_first_of(" \t\r\n/"));
+            if (closing)
+            {
+                if (element == "interface")
+                {
+                    interface.clear();
+                }
+                else if (element != "arg" && element != "annotation")
+                {
+                    current.reset();
+                }
+                continue;
+            }
+            if (element == "interface")
+            {
+                interface = attribute(tag, "name");
+                interfaceChange = "emits-change";
+                members.push_back(Member{interface, "interface"});
+                continue;
+            }
+            if (element == "method" || element == "signal" ||
+                element == "property")
+            {
+                Member member{interface, std::string(element),
+                              attribute(tag, "name")};
+                if (element == "property")
+                {
+                    member.signature = attribute(tag, "type");
+                    member.writable = attribute(tag, "access").contains(
+                        "write");
+                    member.change = interfaceChange;
+                }
+                members.push_back(std::move(member));
+                current = members.size() - 1;
+                if (selfClosing)
+                {
+                    current.reset();
+                }
+                continue;
+            }
+            if (element == "arg" && current)
+            {
+                auto& member = members[*current];
+                auto type = attribute(tag, "type");
+                if (member.type == "method" &&
+                    attribute(tag, "direction") == "out")
+                {
+                    member.result += type;
+                }
+                else
+                {
+                    member.signature += type;
+                }
+                continue;
+            }
+            if (element != "annotation")
+            {
+                continue;
+            }
+            auto name = attribute(tag, "name");
+            auto value = attribute(tag, "value");
+            if (name == "org.freedesktop.DBus.Property.EmitsChangedSignal")
+            {
+                std::string_view change = value == "const" ? "const"
+                                          : value == "invalidates"
+                                              ? "emits-invalidation"
+                                          : value == "false" ? ""
+                                                             : "emits-change";
+                if (current)
+                {
+                    members[*current].change = change;
+                }
+                else
+                {
+                    interfaceChange = change;
+                }
+            }
+            else if (current && value == "true")
+            {
+                if (name == "org.freedesktop.DBus.Deprecated")
+                {
+                    members[*current].deprecated = true;
+                }
+                else if (name == "org.freedesktop.DBus.Method.NoReply")
+                {
+                    members[*current].noReply = true;
+                }
+            }
+        }
+        std::ranges::sort(members, {}, [](const Member& m) {
+            return std::tie(m.interface, m.type, m.name);
+        });
+        return members;
+    }
+    // Fills in property values with one GetAll per interface. Values that
+    // cannot be read stay "-", as in busctl.
+    net::awaitable<void> readProperties(const std::string& service,
+                                        const std::string& path,
+                                        std::vector<Member>& members)
+    {
+        for (const auto& iface : members)
+        {
+            if (iface.type != "interface" ||
+                std::ranges::none_of(members, [&](const Member& m) {
+                    return m.type == "property" &&
+                           m.interface == iface.interface;
+                }))
+            {
+                continue;
+            }
+            auto msg = conn.new_method_call(
+                service.c_str(), path.c_str(),
+                "org.freedesktop.DBus.Properties", "GetAll");
+            msg.append(iface.interface);
+            auto reply = co_await send(msg, "GetAll failed");
+            if (!reply.ok)
+            {
+                continue;
+            }
+            sd_bus_message* m = reply.reply.get();
+            check(sd_bus_message_enter_container(m, SD_BUS_TYPE_ARRAY, "{sv}"),
+                  "enter properties");
+            while (sd_bus_message_enter_container(m, SD_BUS_TYPE_DICT_ENTRY,
+                                                  "sv") > 0)
+            {
+                const char* name = nullptr;
+                check(sd_bus_message_read_basic(m, SD_BUS_TYPE_STRING, &name),
+                      "read property name");
+                std::vector<std::string> words;
+                formatValue(m, words);
+                check(sd_bus_message_exit_container(m), "exit property");
+                // The first word is the variant's signature, which has its
+                // own column
+                words.erase(words.begin());
+                auto it = std::ranges::find_if(members, [&](const Member& p) {
+                    return p.type == "property" &&
+                           p.interface == iface.interface && p.name == name;
+                });
+                if (it != members.end())
+                {
+                    it->value = join(words);
+                }
+            }
+            check(sd_bus_message_exit_container(m), "exit properties");
+        }
+    }
+    // Terminal columns taken by a UTF-8 string
+    static size_t columns(std::string_view s)
+    {
+        return std::ranges::count_if(s, [](char c) {
+            return (static_cast<unsigned char>(c) & 0xc0) != 0x80;
+        });
+    }
+    static std::string introspectTable(const std::vector<Member>& members,
+                                       const Command& command)
+    {
+        const auto& argv = command.argv;
+        bool full = command.has("-l") || command.has("--full");
+        auto dash = [](std::string_view s) {
+            return s.empty() ? std::string("-") : std::string(s);
+        };
+        struct Row
+        {
+            std::string name, type, signature, result, flags;
+        };
+        std::vector<Row> rows;
+        for (const auto& m : members)
+        {
+            bool isInterface = m.type == "interface";
+            if (argv.size() > 3 &&
+                (isInterface || m.interface != argv[3]))
+            {
+                continue;
+            }
+            std::string result = dash(m.result);
+            if (m.value)
+            {
+                result = *m.value;
+                if (!full && columns(result) > valueWidth)
+                {
+                    // Cut on a character boundary, leaving room for "…"
+                    size_t keep = 0;
+                    for (size_t n = 0; n < valueWidth - 1; ++n)
+                    {
+                        do
+                        {
+                            ++keep;
+                        } while (keep < result.size() &&
+                                 (static_cast<unsigned char>(result[keep]) &
+                                  0xc0) == 0x80);
+                    }
+                    result.resize(keep);
+                    result += "…";
+                }
+            }
+            std::string flags;
+            if (m.deprecated)
+            {
+                flags += " deprecated";
+            }
+            if (m.noReply)
+            {
+                flags += " no-reply";
+            }
+            if (!m.change.empty() && m.type == "property")
+            {
+                flags += std::format(" {}", m.change);
+            }
+            if (m.writable)
+            {
+                flags += " writable";
+            }
+            rows.push_back(Row{isInterface ? m.interface : "." + m.name,
+                               m.type, dash(m.signature), std::move(result),
+                               flags.empty() ? " -" : flags});
+        }
+        Row legend{"NAME", "TYPE", "SIGNATURE", "RESULT/VALUE", " FLAGS"};
+        size_t nameWidth = legend.name.size();
+        size_t typeWidth = legend.type.size();
+        size_t signatureWidth = legend.signature.size();
+        size_t resultWidth = legend.result.size();
+        for (const auto& row : rows)
+        {
+            nameWidth = std::max(nameWidth, columns(row.name));
+            typeWidth = std::max(typeWidth, columns(row.type));
+            signatureWidth = std::max(signatureWidth, columns(row.signature));
+            resultWidth = std::max(resultWidth, columns(row.result));
+        }
+        std::string out;
+        auto cell = [&out](const std::string& text, size_t width) {
+            out += text;
+            out.append(width - columns(text), ' ');
+        };
+        auto print = [&](const Row& row) {
+            cell(row.name, nameWidth + 1);
+            cell(row.type, typeWidth + 1);
+            cell(row.signature, signatureWidth + 1);
+            cell(row.result, resultWidth);
+            out += row.flags;
+            out.push_back('\n');
+        };
+        if (!command.has("--no-legend"))
+        {
+            print(legend);
+        }
+        for (const auto& row : rows)
+        {
+            print(row);
+        }
+        return out;
+    }
+    net::awaitable<Result> introspectObject(const Command& command)
+    {
+        const auto& argv = command.argv;
+        if (argv.size() < 3)
+        {
+            co_return Result{false, "introspect: SERVICE OBJECT [INTERFACE] "
+                                    "expected\n"};
+        }
+        auto [ec, xml] = co_await introspect(conn, argv[1], argv[2]);
+        if (ec)
+        {
+            co_return Result{false,
+                             std::format("Failed to introspect object {} of "
+                                         "service {}: {}\n",
+                                         argv[2], argv[1], ec.message())};
+        }
+        if (command.has("--xml-interface"))
+        {
+            co_return Result{true, std::move(xml)};
+        }
+        auto members = parseIntrospection(xml);
+        co_await readProperties(argv[1], argv[2], members);
+        co_return Result{true, introspectTable(members, command)};
+    }
+    net::awaitable<bool> tree(const std::string& service,
+                              const std::string& path,
+                              const std::string& prefix, bool last,
+                              std::string& out)
+    {
+        out += std::format("{}{}{}\n", prefix, last ? "└─ " : "├─ ", path);
+        auto [ec, xml] = co_await introspect(conn, service, path);
+        if (ec)
+        {
+            out += std::format("Failed to introspect object {} of service "
+                               "{}: {}\n",
+                               path, service, ec.message());
+            co_return false;
+        }
+        auto children = childNodes(xml);
+        bool ok = true;
+        for (size_t i = 0; i < children.size(); ++i)
+        {
+            auto child = path == "/" ? "/" + children[i]
+                                     : path + "/" + children[i];
+            ok = co_await tree(service, child, prefix + (last ? "  " : "│ "),
+                               i + 1 == children.size(), out) &&
+                 ok;
+        }
+        co_return ok;
+    }
+    net::awaitable<Result> run(const Command& command)
+    {
+        const auto& argv = command.argv;
+        const auto& verb = argv[0];
+        auto unsupported = std::ranges::find_if_not(command.options,
+                                                    isSupportedOption);
+        if (unsupported != command.options.end())
+        {
+            co_return Result{
+                false, std::format("line {}: unsupported option '{}'\n",
+                                   command.line, *unsupported)};
+        }
+        try
+        {
+            if (verb == "get-property")
+            {
+                co_return co_await getProperty(argv);
+            }
+            if (verb == "set-property")
+            {
+                co_return co_await setProperty(argv);
+            }
+            if (verb == "call")
+            {
+                co_return co_await call(argv);
+            }
+            if (verb == "introspect")
+            {
+                co_return co_await introspectObject(command);
+            }
+            if (verb == "tree" && argv.size() >= 2)
+            {
+                Result result;
+                result.ok = co_await tree(argv[1], "/", "", true,
+                                          result.output);
+                co_return result;
+            }
+        }
+        catch (const std::exception& e)
+        {
+            co_return Result{false, std::format("line {}: {}\n", command.line,
+                                                e.what())};
+        }
+        co_return Result{
+            false, std::format("line {}: unsupported command '{}'\n",
+                               command.line, verb)};
+    }
+    // Runs commands[begin, end) with up to maxInFlight outstanding calls
+    net::awaitable<void> runBatch(const std::vector<Command>& commands,
+                                  size_t begin, size_t end,
+                                  std::vector<Result>& results)
+    {
+        auto executor = co_await net::this_coro::executor;
+        size_t nextIndex = begin;
+        size_t workers = std::min(maxInFlight, end - begin);
+        net::steady_timer done(executor, net::steady_timer::time_point::max());
+        auto worker = [&](size_t lane) -> net::awaitable<void> {
+            // A worker runs one command at a time, so each gets its own
+            // trace track under the run id and its spans never overlap
+            auto track = std::format("{}/{}", runId, lane);
+            while (nextIndex < end && !cancelled)
+            {
+                size_t i = nextIndex++;
+                try
+                {
+                    trace::Span span("dbus_command", track);
+                    results[i] = co_await run(commands[i]);
+                }
+                catch (const std::exception& e)
+                {
+                    results[i] = Result{false, std::format("{}\n", e.what())};
+                }
+            }
+            if (--workers == 0)
+            {
+                done.cancel();
+            }
+        };
+        for (size_t i = workers; i > 0; --i)
+        {
+            net::co_spawn(executor, worker(i), net::detached);
+        }
+        if (workers > 0)
+        {
+            boost::system::error_code ec;
+            co_await done.async_wait(
+                net::redirect_error(net::use_awaitable, ec));
+        }
+    }
+    // Calls onOutput with each command's output in script order as soon as
+    // it and everything before it has completed. Returns false if any
+    // command failed.
+    template <typename OnOutput>
+    net::awaitable<bool> execute(std::string script, OnOutput onOutput)
+    {
+        auto commands = parse(script);
+        std::vector<Result> results(commands.size());
+        bool ok = true;
+        size_t begin = 0;
+        while (begin < commands.size() && !cancelled)
+        {
+            size_t end = begin + 1;
+            if (!isBarrier(commands[begin]))
+            {
+                while (end < commands.size() && !isBarrier(commands[end]))
+                {
+                    ++end;
+                }
+            }
+            co_await runBatch(commands, begin, end, results);
+            for (size_t i = begin; i < end; ++i)
+            {
+                ok = ok && results[i].ok;
+                onOutput(results[i].output);
+                results[i] = Result{};
+            }
+            begin = end;
+        }
+        co_return ok && !cancelled;
+    }
+    sdbusplus::asio::connection& conn;
+    std::string runId;
+    bool cancelled = false;
+};
+} // namespace scrrunner
@@ -0,0 +1,213 @@
+#pragma once
+#include "logger.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+namespace scrrunner
+{
+// Admission control for runs, keyed by the caller's D-Bus sender. Each
+// sender has a token bucket limiting how fast it may submit and a cap on
+// how many of its runs execute at once. Runs that cannot start yet wait
+// in a per-sender queue, and free slots are handed out round robin across
+// senders so a burst from one client cannot starve the others.
+struct FairScheduler
+{
+    using Clock = std::chrono::steady_clock;
+    using Job = std::function<bool()>;
+    struct Limits
+    {
+        double rate = 5.0;
+        double burst = 10.0;
+        size_t perSender = 4;
+        size_t total = 8;
+        size_t maxQueued = 32;
+    };
+    enum class Admission
+    {
+        started,
+        queued,
+        rejected
+    };
+    struct Pending
+    {
+        std::string runId;
+        Job job;
+    };
+    struct Sender
+    {
+        double tokens;
+        Clock::time_point refilled;
+        size_t running = 0;
+        std::deque<Pending> queue;
+    };
+    explicit FairScheduler(Limits limits) : limits(limits) {}
+
+    bool takeToken(const std::string& name)
+    {
+        auto now = Clock::now();
+        auto [it, inserted] =
+            senders.try_emplace(name, Sender{limits.burst, now});
+        auto& sender = it->second;
+        std::chrono::duration<double> elapsed = now - sender.refilled;
+        sender.tokens = std::min(limits.burst,
+                                 sender.tokens + elapsed.count() * limits.rate);
+        sender.refilled = now;
+        if (sender.tokens < 1.0)
+        {
+            LOG_WARNING("Rate limit exceeded for {}", name);
+            return false;
+        }
+        sender.tokens -= 1.0;
+        return true;
+    }
+    Admission submit(const std::string& name, const std::string& runId,
+                     Job job)
+    {
+        prune();
+        if (!takeToken(name))
+        {
+            return Admission::rejected;
+        }
+        return enqueue(name, runId, std::move(job));
+    }
+    // Like submit, for runs the sender already paid a token for, such as
+    // the nodes of a graph
+    Admission enqueue(const std::string& name, const std::string& runId,
+                      Job job)
+    {
+        auto& sender =
+            senders.try_emplace(name, Sender{limits.burst, Clock::now()})
+                .first->second;
+        if (sender.queue.empty() && sender.running < limits.perSender &&
+            running < limits.total)
+        {
+            return start(name, sender, runId, job) ? Admission::started
+                                                   : Admission::rejected;
+        }
+        if (sender.queue.size() >= limits.maxQueued)
+        {
+            LOG_WARNING("Run queue full for {}", name);
+            return Admission::rejected;
+        }
+        sender.queue.push_back(Pending{runId, std::move(job)});
+        return Admission::queued;
+    }
+    bool start(const std::string& name, Sender& sender,
+               const std::string& runId, const Job& job)
+    {
+        // Slots are released by run id, so two runs can never share one
+        if (owners.contains(runId))
+        {
+            LOG_ERROR("Run {} is already active", runId);
+            return false;
+        }
+        if (!job())
+        {
+            return false;
+        }
+        ++sender.running;
+        ++running;
+        owners.insert_or_assign(runId, name);
+        return true;
+    }
+    // Hands free slots to queued runs, one sender at a time in turn
+    void dispatch()
+    {
+        bool progress = true;
+        while (progress && running < limits.total)
+        {
+            progress = false;
+            auto it = senders.upper_bound(lastServed);
+            for (size_t i = 0; i < senders.size(); ++i, ++it)
+            {
+                if (it == senders.end())
+                {
+                    it = senders.begin();
+                }
+                auto& [name, sender] = *it;
+                if (sender.queue.empty() || sender.running >= limits.perSender)
+                {
+                    continue;
+                }
+                auto pending = std::move(sender.queue.front());
+                sender.queue.pop_front();
+                lastServed = name;
+                if (!start(name, sender, pending.runId, pending.job))
+                {
+                    LOG_ERROR("Failed to start queued run {}", pending.runId);
+                }
+                progress = true;
+                break;
+            }
+        }
+    }
+    void finished(const std::string& runId)
+    {
+        auto owner = owners.find(runId);
+        if (owner == owners.end())
+        {
+            return;
+        }
+        auto sender = senders.find(owner->second);
+        if (sender != senders.end() && sender->second.running > 0)
+        {
+            --sender->second.running;
+        }
+        owners.erase(owner);
+        --running;
+        dispatch();
+    }
+    bool cancel(const std::string& runId)
+    {
+        for (auto& [name, sender] : senders)
+        {
+            auto removed = std::erase_if(sender.queue, [&](const auto& p) {
+                return p.runId == runId;
+            });
+            if (removed > 0)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+    std::vector<std::string> queued() const
+    {
+        std::vector<std::string> result;
+        for (const auto& [name, sender] : senders)
+        {
+            for (const auto& pending : sender.queue)
+            {
+                result.push_back(pending.runId);
+            }
+        }
+        return result;
+    }
+    // Forget idle senders whose bucket has refilled, so short lived
+    // connections do not accumulate
+    void prune()
+    {
+        if (senders.size() < 64)
+        {
+            return;
+        }
+        auto now = Clock::now();
+        std::erase_if(senders, [&](const auto& entry) {
+            const auto& sender = entry.second;
+            std::chrono::duration<double> idle = now - sender.refilled;
+            return sender.running == 0 && sender.queue.empty() &&
+                   sender.tokens + idle.count() * limits.rate >= limits.burst;
+        });
+    }
+    Limits limits;
+    std::map<std::string, Sender> senders;
+    std::map<std::string, std::string> owners;
+    std::string lastServed;
+    size_t running = 0;
+};
+} // namespace scrrunner
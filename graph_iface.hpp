@@ -0,0 +1,273 @@
+#pragma once
+#include "script_runner.hpp"
+#include "sdbus_calls_runner.hpp"
+
+#include <algorithm>
+#include <format>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <tuple>
+#include <vector>
+namespace scrrunner
+{
+struct GraphIface
+{
+    // (name, script, dependencies, timeout in seconds)
+    using NodeSpec = std::tuple<std::string, std::string,
+                                std::vector<std::string>, uint64_t>;
+    struct Node
+    {
+        std::string name;
+        std::string script;
+        std::vector<std::string> deps;
+        uint64_t timeout;
+        std::string runId;
+        std::string status = "pending";
+    };
+    using Launcher = std::function<bool(const Node&)>;
+    using Canceller = std::function<void(const std::string&)>;
+    static constexpr auto graphPath = "/xyz/openbmc_project/acfshell/{}";
+    static constexpr auto graphInterface = "xyz.openbmc_project.TacfGraph";
+
+    // Returns why the nodes do not form a DAG, or an empty string
+    static std::string validate(const std::vector<NodeSpec>& specs)
+    {
+        std::map<std::string, size_t> indegree;
+        std::map<std::string, std::vector<std::string>> dependents;
+        for (const auto& [name, script, deps, timeout] : specs)
+        {
+            if (name.empty() || script.empty() ||
+                !indegree.emplace(name, deps.size()).second)
+            {
+                return std::format("invalid or duplicate node '{}'", name);
+            }
+            for (const auto& dep : deps)
+            {
+                dependents[dep].push_back(name);
+            }
+        }
+        for (const auto& [dep, users] : dependents)
+        {
+            if (!indegree.contains(dep))
+            {
+                return std::format("unknown dependency '{}'", dep);
+            }
+        }
+        // Kahn's algorithm; anything left over sits on a cycle
+        std::vector<std::string> ready;
+        for (const auto& [name, count] : indegree)
+        {
+            if (count == 0)
+            {
+                ready.push_back(name);
+            }
+        }
+        size_t visited = 0;
+        while (!ready.empty())
+        {
+            auto name = std::move(ready.back());
+            ready.pop_back();
+            ++visited;
+            for (const auto& user : dependents[name])
+            {
+                if (--indegree[user] == 0)
+                {
+                    ready.push_back(user);
+                }
+            }
+        }
+        if (visited != specs.size())
+        {
+            return "dependency cycle";
+        }
+        return {};
+    }
+    GraphIface(const std::string& id, const std::vector<NodeSpec>& specs,
+               bool failFast, sdbusplus::asio::object_server& objServer,
+               Launcher launcher, Canceller canceller) :
+        id(id), failFast(failFast), objServer(objServer),
+        launcher(std::move(launcher)), canceller(std::move(canceller))
+    {
+        for (const auto& [name, script, deps, timeout] : specs)
+        {
+            auto runId = ScriptRunner::makeHash(
+                std::format("{}\n{}\n{}", id, name, script));
+            if (!runId)
+            {
+                throw std::runtime_error("Failed to create node hash");
+            }
+            nodes.push_back(Node{name, script, deps, timeout, *runId});
+        }
+        std::string path = std::format(graphPath, id);
+        dbusIface = objServer.add_interface(path, graphInterface);
+        dbusIface->register_property("Status", status);
+        dbusIface->register_property("Nodes", nodeStatus());
+        dbusIface->register_method("cancel", [this]() {
+            fail("cancelled");
+            return true;
+        });
+        dbusIface->initialize();
+    }
+    ~GraphIface()
+    {
+        objServer.remove_interface(dbusIface);
+    }
+    std::map<std::string, std::string> nodeStatus() const
+    {
+        std::map<std::string, std::string> result;
+        for (const auto& node : nodes)
+        {
+            result.emplace(node.name, node.status);
+        }
+        return result;
+    }
+    Node* findNode(const std::string& name)
+    {
+        for (auto& node : nodes)
+        {
+            if (node.name == name)
+            {
+                return &node;
+            }
+        }
+        return nullptr;
+    }
+    Node* findRun(const std::string& runId)
+    {
+        for (auto& node : nodes)
+        {
+            if (node.runId == runId)
+            {
+                return &node;
+            }
+        }
+        return nullptr;
+    }
+    bool done() const
+    {
+        return status != "running";
+    }
+    size_t count(std::string_view state) const
+    {
+        return std::ranges::count_if(
+            nodes, [state](const Node& node) { return node.status == state; });
+    }
+    // Start every pending node whose dependencies have all succeeded, and
+    // skip the ones that can no longer run.
+    void schedule()
+    {
+        bool progress = true;
+        while (progress)
+        {
+            progress = false;
+            for (auto& node : nodes)
+            {
+                if (node.status != "pending")
+                {
+                    continue;
+                }
+                bool ready = true;
+                bool blocked = false;
+                for (const auto& dep : node.deps)
+                {
+                    const auto& state = findNode(dep)->status;
+                    ready = ready && state == "succeeded";
+                    blocked = blocked ||
+                              (state != "pending" && state != "running" &&
+                               state != "succeeded");
+                }
+                if (blocked)
+                {
+                    node.status = "skipped";
+                    progress = true;
+                }
+                else if (ready)
+                {
+                    node.status = "running";
+                    if (!launcher(node))
+                    {
+                        LOG_ERROR("Failed to start graph node {}", node.name);
+                        node.status = "failed";
+                        if (failFast)
+                        {
+                            fail("failed");
+                            return;
+                        }
+                    }
+                    progress = true;
+                }
+            }
+        }
+        if (count("pending") == 0 && count("running") == 0 && !done())
+        {
+            status = count("succeeded") == nodes.size() ? "succeeded"
+                                                         : "failed";
+            LOG_INFO("Graph {} {}", id, status);
+        }
+        publish();
+    }
+    // Returns true if the run belonged to this graph
+    bool onRunFinished(boost::system::error_code ec, const std::string& runId)
+    {
+        auto node = findRun(runId);
+        if (node == nullptr)
+        {
+            return false;
+        }
+        if (node->status != "running")
+        {
+            return true;
+        }
+        node->status = ec ? "failed" : "succeeded";
+        if (ec && failFast)
+        {
+            fail("failed");
+            return true;
+        }
+        schedule();
+        return true;
+    }
+    void fail(const std::string& finalStatus)
+    {
+        if (done())
+        {
+            return;
+        }
+        status = finalStatus;
+        std::vector<std::string> running;
+        for (auto& node : nodes)
+        {
+            if (node.status == "pending")
+            {
+                node.status = "skipped";
+            }
+            else if (node.status == "running")
+            {
+                // Mark first so the cancel callback is ignored
+                node.status = "cancelled";
+                running.push_back(node.runId);
+            }
+        }
+        for (const auto& runId : running)
+        {
+            canceller(runId);
+        }
+        publish();
+    }
+    void publish()
+    {
+        dbusIface->set_property("Status", status);
+        dbusIface->set_property("Nodes", nodeStatus());
+    }
+    std::string id;
+    bool failFast;
+    std::string status = "running";
+    std::vector<Node> nodes;
+    sdbusplus::asio::object_server& objServer;
+    Launcher launcher;
+    Canceller canceller;
+    std::shared_ptr<sdbusplus::asio::dbus_interface> dbusIface;
+};
+} // namespace scrrunner
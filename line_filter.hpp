@@ -0,0 +1,241 @@
+#pragma once
+#include <string.h>
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+namespace scrrunner
+{
+// Streaming literal line matcher. Instead of walking every line it jumps
+// between candidate hits and between lines with memchr/memrchr, which
+// glibc implements with vector instructions, so non matching output is
+// skipped at close to memory bandwidth. Candidates are found by scanning
+// for the rarest byte of each pattern and confirmed with memcmp.
+struct LineFilter
+{
+    // Matching lines are reported truncated to maxLine bytes, and a line
+    // split across chunks is only matched on its first maxLine bytes
+    static constexpr size_t maxLine = 64 * 1024;
+    // Called with the absolute offset of a matching line and the line
+    // without its newline. Return false to stop matching.
+    using OnMatch = std::function<bool(uint64_t, std::string_view)>;
+    LineFilter(std::vector<std::string> patterns, OnMatch onMatch) :
+        onMatch(std::move(onMatch))
+    {
+        for (auto& pattern : patterns)
+        {
+            // A match can never span lines, so a newline can never match
+            if (!pattern.empty() && pattern.find('\n') == std::string::npos)
+            {
+                anchors.push_back(rarestByte(pattern));
+                this->patterns.push_back(std::move(pattern));
+            }
+        }
+    }
+    // Rough byte frequencies in command output: letters, digits, space and
+    // common punctuation are frequent, everything else is rare
+    static size_t rarestByte(std::string_view pattern)
+    {
+        static constexpr std::array<uint8_t, 256> rank = [] {
+            std::array<uint8_t, 256> r{};
+            for (unsigned char c : std::string_view("etaoinsrhldcu"))
+            {
+                r[c] = 4;
+            }
+            for (unsigned char c = 'a'; c <= 'z'; ++c)
+            {
+                r[c] = std::max<uint8_t>(r[c], 2);
+            }
+            for (unsigned char c = '0'; c <= '9'; ++c)
+            {
+                r[c] = 3;
+            }
+            for (unsigned char c : std::string_view(" .:=,_-/"))
+            {
+                r[c] = 5;
+            }
+            for (unsigned char c = 'A'; c <= 'Z'; ++c)
+            {
+                r[c] = 1;
+            }
+            return r;
+        }();
+        size_t best = 0;
+        for (size_t i = 1; i < pattern.size(); ++i)
+        {
+            if (rank[static_cast<unsigned char>(pattern[i])] <
+                rank[static_cast<unsigned char>(pattern[best])])
+            {
+                best = i;
+            }
+        }
+        return best;
+    }
+    bool active() const
+    {
+        return !stopped && !patterns.empty();
+    }
+    void feed(const char* data, size_t size)
+    {
+        if (!active() || size == 0)
+        {
+            offset += size;
+            return;
+        }
+        const char* end = data + size;
+        const char* lastNl =
+            static_cast<const char*>(memrchr(data, '\n', size));
+        if (lastNl == nullptr)
+        {
+            extendCarry(data, size, offset);
+            offset += size;
+            return;
+        }
+        const char* regionBegin = data;
+        if (carried)
+        {
+            // Complete the line left over from the previous chunk
+            const char* firstNl =
+                static_cast<const char*>(memchr(data, '\n', size));
+            extendCarry(data, firstNl - data, carryOffset);
+            if (matchesAny(carry))
+            {
+                emit(carryOffset, carry);
+            }
+            carry.clear();
+            carried = false;
+            regionBegin = firstNl + 1;
+        }
+        if (active())
+        {
+            uint64_t regionOffset = offset + (regionBegin - data);
+            scanRegion(regionBegin, lastNl + 1, regionOffset);
+        }
+        if (lastNl + 1 < end)
+        {
+            extendCarry(lastNl + 1, end - lastNl - 1,
+                        offset + (lastNl + 1 - data));
+        }
+        offset += size;
+    }
+    void finish()
+    {
+        if (active() && carried && matchesAny(carry))
+        {
+            emit(carryOffset, carry);
+        }
+        carry.clear();
+        carried = false;
+    }
+    void extendCarry(const char* data, size_t size, uint64_t lineOffset)
+    {
+        if (!carried)
+        {
+            carryOffset = lineOffset;
+            carried = true;
+        }
+        carry.append(data, std::min(size, maxLine - carry.size()));
+    }
+    // Start of the next occurrence of patterns[i] in [pos, end)
+    const char* find(size_t i, const char* pos, const char* end) const
+    {
+        const auto& pattern = patterns[i];
+        size_t len = pattern.size();
+        if (static_cast<size_t>(end - pos) < len)
+        {
+            return nullptr;
+        }
+        size_t anchor = anchors[i];
+        char c = pattern[anchor];
+        const char* scan = pos + anchor;
+        const char* last = end - len + anchor;
+        while (scan <= last)
+        {
+            const char* hit =
+                static_cast<const char*>(memchr(scan, c, last - scan + 1));
+            if (hit == nullptr)
+            {
+                return nullptr;
+            }
+            const char* start = hit - anchor;
+            if (memcmp(start, pattern.data(), len) == 0)
+            {
+                return start;
+            }
+            scan = hit + 1;
+        }
+        return nullptr;
+    }
+    bool matchesAny(std::string_view line) const
+    {
+        const char* end = line.data() + line.size();
+        for (size_t i = 0; i < patterns.size(); ++i)
+        {
+            if (find(i, line.data(), end) != nullptr)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+    // [begin, end) holds whole lines, the last one ending in '\n'
+    void scanRegion(const char* begin, const char* end, uint64_t baseOffset)
+    {
+        hits.clear();
+        for (size_t i = 0; i < patterns.size(); ++i)
+        {
+            const char* pos = begin;
+            while (pos < end)
+            {
+                const char* hit = find(i, pos, end);
+                if (hit == nullptr)
+                {
+                    break;
+                }
+                const char* lineBegin = static_cast<const char*>(
+                    memrchr(begin, '\n', hit - begin));
+                lineBegin = lineBegin == nullptr ? begin : lineBegin + 1;
+                const char* lineEnd = static_cast<const char*>(
+                    memchr(hit, '\n', end - hit));
+                hits.emplace_back(lineBegin - begin, lineEnd - begin);
+                pos = lineEnd + 1;
+            }
+        }
+        std::ranges::sort(hits);
+        auto [first, last] = std::ranges::unique(hits);
+        hits.erase(first, last);
+        for (const auto& [lineBegin, lineEnd] : hits)
+        {
+            size_t length = std::min(lineEnd - lineBegin, maxLine);
+            if (!emit(baseOffset + lineBegin,
+                      std::string_view(begin + lineBegin, length)))
+            {
+                break;
+            }
+        }
+    }
+    bool emit(uint64_t lineOffset, std::string_view line)
+    {
+        if (!onMatch(lineOffset, line))
+        {
+            stopped = true;
+        }
+        return !stopped;
+    }
+    std::vector<std::string> patterns;
+    // Index of the byte of each pattern that candidates are scanned for
+    std::vector<size_t> anchors;
+    OnMatch onMatch;
+    std::string carry;
+    uint64_t carryOffset = 0;
+    bool carried = false;
+    std::vector<std::pair<size_t, size_t>> hits;
+    uint64_t offset = 0;
+    bool stopped = false;
+};
+} // namespace scrrunner
@@ -0,0 +1,261 @@
+#pragma once
+#include "logger.hpp"
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <map>
+#include <string>
+#include <string_view>
+namespace scrrunner
+{
+namespace metrics
+{
+using Clock = std::chrono::steady_clock;
+// Each thread records into its own cache line so the hot path is a single
+// relaxed fetch_add with no sharing; readers sum the shards.
+constexpr size_t shardCount = 8;
+inline size_t shardIndex()
+{
+    static std::atomic<size_t> next{0};
+    thread_local size_t index =
+        next.fetch_add(1, std::memory_order_relaxed) % shardCount;
+    return index;
+}
+struct Counter
+{
+    struct alignas(64) Shard
+    {
+        std::atomic<uint64_t> value{0};
+    };
+    void inc(uint64_t n = 1)
+    {
+        shards[shardIndex()].value.fetch_add(n, std::memory_order_relaxed);
+    }
+    uint64_t value() const
+    {
+        uint64_t total = 0;
+        for (const auto& shard : shards)
+        {
+            total += shard.value.load(std::memory_order_relaxed);
+        }
+        return total;
+    }
+    std::array<Shard, shardCount> shards;
+};
+struct Histogram
+{
+    // Bucket upper bounds in microseconds; the last bucket is +Inf
+    static constexpr std::array<uint64_t, 12> bounds{
+        10,    50,     100,    500,     1000,    5000,
+        10000, 50000,  100000, 500000, 1000000, 10000000};
+    struct alignas(64) Shard
+    {
+        std::array<std::atomic<uint64_t>, bounds.size() + 1> buckets{};
+        std::atomic<uint64_t> sum{0};
+    };
+    void observe(Clock::duration d)
+    {
+        auto us = static_cast<uint64_t>(
+            std::chrono::duration_cast<std::chrono::microseconds>(d).count());
+        size_t bucket = 0;
+        while (bucket < bounds.size() && us > bounds[bucket])
+        {
+            ++bucket;
+        }
+        auto& shard = shards[shardIndex()];
+        shard.buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+        shard.sum.fetch_add(us, std::memory_order_relaxed);
+    }
+    uint64_t bucket(size_t index) const
+    {
+        uint64_t total = 0;
+        for (const auto& shard : shards)
+        {
+            total += shard.buckets[index].load(std::memory_order_relaxed);
+        }
+        return total;
+    }
+    uint64_t count() const
+    {
+        uint64_t total = 0;
+        for (size_t i = 0; i <= bounds.size(); ++i)
+        {
+            total += bucket(i);
+        }
+        return total;
+    }
+    uint64_t sumUs() const
+    {
+        uint64_t total = 0;
+        for (const auto& shard : shards)
+        {
+            total += shard.sum.load(std::memory_order_relaxed);
+        }
+        return total;
+    }
+    std::array<Shard, shardCount> shards;
+};
+struct ScopedTimer
+{
+    explicit ScopedTimer(Histogram& histogram) : histogram(histogram) {}
+    ScopedTimer(const ScopedTimer&) = delete;
+    ScopedTimer& operator=(const ScopedTimer&) = delete;
+    ~ScopedTimer()
+    {
+        histogram.observe(Clock::now() - start);
+    }
+    Histogram& histogram;
+    Clock::time_point start = Clock::now();
+};
+} // namespace metrics
+
+struct Metrics
+{
+    metrics::Counter runsStarted;
+    metrics::Counter runsFinished;
+    metrics::Counter runsCancelled;
+    metrics::Counter runsTimedOut;
+    metrics::Counter outputBytes;
+    metrics::Counter dumpCalls;
+    metrics::Counter stalls;
+    metrics::Histogram queueWait;
+    metrics::Histogram launchLatency;
+    metrics::Histogram firstByte;
+    metrics::Histogram runDuration;
+    metrics::Histogram loopLag;
+    // Populated when methods are registered, never on the hot path
+    std::map<std::string, metrics::Histogram, std::less<>> methodLatency;
+
+    metrics::Histogram& method(std::string_view name)
+    {
+        auto it = methodLatency.find(name);
+        if (it == methodLatency.end())
+        {
+            it = methodLatency.try_emplace(std::string(name)).first;
+        }
+        return it->second;
+    }
+    std::array<std::pair<std::string_view, metrics::Histogram*>, 5>
+        runHistograms()
+    {
+        return {{{"queue_wait", &queueWait},
+                 {"launch_latency", &launchLatency},
+                 {"first_byte", &firstByte},
+                 {"run_duration", &runDuration},
+                 {"loop_lag", &loopLag}}};
+    }
+    std::map<std::string, metrics::Histogram*> histograms()
+    {
+        std::map<std::string, metrics::Histogram*> all;
+        for (const auto& [name, histogram] : runHistograms())
+        {
+            all.emplace(name, histogram);
+        }
+        for (auto& [name, histogram] : methodLatency)
+        {
+            all.emplace(std::format("method_{}", name), &histogram);
+        }
+        return all;
+    }
+    static void writeCounter(std::string& out, std::string_view name,
+                             std::string_view help,
+                             const metrics::Counter& counter)
+    {
+        out += std::format("# TYPE acfshell_{0} counter\n"
+                           "# HELP acfshell_{0} {1}\n"
+                           "acfshell_{0}_total {2}\n",
+                           name, help, counter.value());
+    }
+    static void writeHistogram(std::string& out, std::string_view name,
+                               std::string_view labels,
+                               const metrics::Histogram& histogram)
+    {
+        std::string sep = labels.empty() ? "" : ",";
+        uint64_t cumulative = 0;
+        for (size_t i = 0; i < metrics::Histogram::bounds.size(); ++i)
+        {
+            cumulative += histogram.bucket(i);
+            out += std::format(
+                "acfshell_{}_seconds_bucket{{{}{}le=\"{}\"}} {}\n", name,
+                labels, sep, metrics::Histogram::bounds[i] / 1e6, cumulative);
+        }
+        cumulative += histogram.bucket(metrics::Histogram::bounds.size());
+        out += std::format(
+            "acfshell_{0}_seconds_bucket{{{1}{2}le=\"+Inf\"}} {3}\n"
+            "acfshell_{0}_seconds_sum{4} {5}\n"
+            "acfshell_{0}_seconds_count{4} {3}\n",
+            name, labels, sep, cumulative,
+            labels.empty() ? std::string{} : std::format("{{{}}}", labels),
+            histogram.sumUs() / 1e6);
+    }
+    std::string toOpenMetrics()
+    {
+        std::string out;
+        writeCounter(out, "runs_started", "Runs started.", runsStarted);
+        writeCounter(out, "runs_finished", "Runs that ran to completion.",
+                     runsFinished);
+        writeCounter(out, "runs_cancelled",
+                     "Runs cancelled, including timeouts.", runsCancelled);
+        writeCounter(out, "runs_timed_out", "Runs cancelled by their timeout.",
+                     runsTimedOut);
+        writeCounter(out, "output_bytes", "Bytes of script output stored.",
+                     outputBytes);
+        writeCounter(out, "dump_calls", "CreateDump calls issued.", dumpCalls);
+        writeCounter(out, "stalls",
+                     "Operations that blocked the event loop too long.",
+                     stalls);
+        for (const auto& [name, histogram] : runHistograms())
+        {
+            out += std::format("# TYPE acfshell_{}_seconds histogram\n", name);
+            writeHistogram(out, name, "", *histogram);
+        }
+        out += "# TYPE acfshell_dbus_method_seconds histogram\n";
+        for (const auto& [name, histogram] : methodLatency)
+        {
+            writeHistogram(out, "dbus_method",
+                           std::format("method=\"{}\"", name), histogram);
+        }
+        out += "# EOF\n";
+        return out;
+    }
+    bool writeFile(const std::string& path)
+    {
+        // Write to a sibling and rename so scrapers never see a partial file
+        std::string tmpPath = path + ".tmp";
+        std::error_code ec;
+        std::filesystem::create_directories(
+            std::filesystem::path(path).parent_path(), ec);
+        {
+            std::ofstream ofs(tmpPath, std::ios::trunc);
+            if (!ofs)
+            {
+                LOG_ERROR("Failed to open metrics file: {}", tmpPath);
+                return false;
+            }
+            ofs << toOpenMetrics();
+            if (!ofs)
+            {
+                LOG_ERROR("Failed to write metrics file: {}", tmpPath);
+                return false;
+            }
+        }
+        std::filesystem::rename(tmpPath, path, ec);
+        if (ec)
+        {
+            LOG_ERROR("Failed to publish metrics file: {}", ec.message());
+            return false;
+        }
+        return true;
+    }
+};
+inline Metrics& getMetrics()
+{
+    static Metrics metrics;
+    return metrics;
+}
+} // namespace scrrunner
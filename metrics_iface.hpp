@@ -0,0 +1,102 @@
+#pragma once
+#include "metrics.hpp"
+#include "sdbus_calls_runner.hpp"
+#include "trace.hpp"
+
+#include <chrono>
+#include <map>
+#include <memory>
+#include <string>
+#include <tuple>
+namespace scrrunner
+{
+struct MetricsIface
+{
+    using Latencies = std::map<std::string, std::tuple<uint64_t, uint64_t>>;
+    static constexpr auto metricsInterface = "xyz.openbmc_project.TacfMetrics";
+    static constexpr auto metricsFile = "/tmp/acf/acfshell.metrics";
+    // PublishInterval bounds in seconds. Larger values would overflow the
+    // timer's duration and make it fire immediately, over and over.
+    static constexpr uint64_t minInterval = 1;
+    static constexpr uint64_t maxInterval = 24 * 60 * 60;
+    MetricsIface(net::io_context& ioc,
+                 sdbusplus::asio::object_server& objServer,
+                 const std::string& path) :
+        io_context(ioc), objServer(objServer), publishTimer(io_context)
+    {
+        auto& m = getMetrics();
+        dbusIface = objServer.add_interface(path, metricsInterface);
+        dbusIface->register_property("RunsStarted", m.runsStarted.value());
+        dbusIface->register_property("RunsFinished", m.runsFinished.value());
+        dbusIface->register_property("RunsCancelled", m.runsCancelled.value());
+        dbusIface->register_property("RunsTimedOut", m.runsTimedOut.value());
+        dbusIface->register_property("OutputBytes", m.outputBytes.value());
+        dbusIface->register_property("DumpCalls", m.dumpCalls.value());
+        dbusIface->register_property("Stalls", m.stalls.value());
+        // Histograms are published as name -> (count, sum in microseconds)
+        dbusIface->register_property("Latencies", latencies());
+        dbusIface->register_property(
+            "PublishInterval", interval,
+            [this](const uint64_t& requested, uint64_t& current) {
+                if (requested < minInterval || requested > maxInterval)
+                {
+                    LOG_ERROR("PublishInterval must be {} to {} seconds",
+                              minInterval, maxInterval);
+                    return false;
+                }
+                current = requested;
+                interval = requested;
+                startPublish();
+                return true;
+            });
+        dbusIface->initialize();
+        startPublish();
+    }
+    ~MetricsIface()
+    {
+        publishTimer.cancel();
+        objServer.remove_interface(dbusIface);
+    }
+    static Latencies latencies()
+    {
+        Latencies result;
+        for (const auto& [name, histogram] : getMetrics().histograms())
+        {
+            result.emplace(name, std::make_tuple(histogram->count(),
+                                                 histogram->sumUs()));
+        }
+        return result;
+    }
+    void publish()
+    {
+        auto& m = getMetrics();
+        dbusIface->set_property("RunsStarted", m.runsStarted.value());
+        dbusIface->set_property("RunsFinished", m.runsFinished.value());
+        dbusIface->set_property("RunsCancelled", m.runsCancelled.value());
+        dbusIface->set_property("RunsTimedOut", m.runsTimedOut.value());
+        dbusIface->set_property("OutputBytes", m.outputBytes.value());
+        dbusIface->set_property("DumpCalls", m.dumpCalls.value());
+        dbusIface->set_property("Stalls", m.stalls.value());
+        dbusIface->set_property("Latencies", latencies());
+        trace::Span span("write_metrics", {}, trace::blocking);
+        m.writeFile(metricsFile);
+    }
+    void startPublish()
+    {
+        publishTimer.expires_after(std::chrono::seconds(interval));
+        publishTimer.async_wait([this](const boost::system::error_code& ec) {
+            if (ec)
+            {
+                return;
+            }
+            publish();
+            startPublish();
+        });
+    }
+    net::io_context& io_context;
+    sdbusplus::asio::object_server& objServer;
+    std::shared_ptr<sdbusplus::asio::dbus_interface> dbusIface;
+    boost::asio::steady_timer publishTimer;
+    uint64_t interval = 10;
+};
+} // namespace scrrunner
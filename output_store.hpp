@@ -0,0 +1,318 @@
+#pragma once
+#include "chunk_store.hpp"
+#include "logger.hpp"
+
+#include <zlib.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+namespace scrrunner
+{
+// Compressed output is a sequence of independent zlib frames in <id>.outz
+// plus an index in <id>.outz.idx, so a read only inflates the frames that
+// overlap the requested range.
+struct Frame
+{
+    uint64_t rawOffset;
+    uint64_t fileOffset;
+    uint32_t rawSize;
+    uint32_t packedSize;
+};
+struct FrameWriter
+{
+    static constexpr size_t frameSize = 128 * 1024;
+    static constexpr int level = 3;
+    explicit FrameWriter(const std::string& path) :
+        data(path, std::ios::binary | std::ios::trunc),
+        index(path + ".idx", std::ios::binary | std::ios::trunc)
+    {
+        pending.reserve(frameSize);
+    }
+    explicit operator bool() const
+    {
+        return data && index;
+    }
+    void write(const char* buf, size_t size)
+    {
+        while (size > 0)
+        {
+            size_t n = std::min(size, frameSize - pending.size());
+            pending.insert(pending.end(), buf, buf + n);
+            buf += n;
+            size -= n;
+            if (pending.size() == frameSize)
+            {
+                flush();
+            }
+        }
+    }
+    void flush()
+    {
+        if (pending.empty())
+        {
+            return;
+        }
+        uLongf packedSize = compressBound(pending.size());
+        packed.resize(packedSize);
+        if (compress2(packed.data(), &packedSize,
+                      reinterpret_cast<const Bytef*>(pending.data()),
+                      pending.size(), level) != Z_OK)
+        {
+            LOG_ERROR("Failed to compress output frame");
+            pending.clear();
+            return;
+        }
+        Frame frame{rawOffset, fileOffset,
+                    static_cast<uint32_t>(pending.size()),
+                    static_cast<uint32_t>(packedSize)};
+        data.write(reinterpret_cast<const char*>(packed.data()),
+                   static_cast<std::streamsize>(packedSize));
+        // Readers of a run in progress trust the index, so a frame must be
+        // on disk before the entry pointing at it
+        data.flush();
+        index.write(reinterpret_cast<const char*>(&frame), sizeof(frame));
+        index.flush();
+        rawOffset += pending.size();
+        fileOffset += packedSize;
+        pending.clear();
+    }
+    void close()
+    {
+        flush();
+        data.close();
+        index.close();
+    }
+    std::ofstream data;
+    std::ofstream index;
+    std::vector<char> pending;
+    std::vector<Bytef> packed;
+    uint64_t rawOffset = 0;
+    uint64_t fileOffset = 0;
+};
+struct FrameReader
+{
+    explicit FrameReader(const std::string& path) :
+        data(path, std::ios::binary)
+    {
+        std::ifstream index(path + ".idx", std::ios::binary);
+        Frame frame{};
+        while (index.read(reinterpret_cast<char*>(&frame), sizeof(frame)))
+        {
+            frames.push_back(frame);
+        }
+    }
+    // Inflate the frame holding rawOffset, reusing the last one if possible
+    const Frame* load(uint64_t rawOffset)
+    {
+        auto it = std::ranges::upper_bound(frames, rawOffset, {},
+                                           &Frame::rawOffset);
+        if (it == frames.begin())
+        {
+            return nullptr;
+        }
+        const Frame& frame = *std::prev(it);
+        if (rawOffset >= frame.rawOffset + frame.rawSize)
+        {
+            return nullptr;
+        }
+        if (current == &frame)
+        {
+            return current;
+        }
+        std::vector<Bytef> packed(frame.packedSize);
+        data.clear();
+        data.seekg(static_cast<std::streamoff>(frame.fileOffset));
+        data.read(reinterpret_cast<char*>(packed.data()), frame.packedSize);
+        raw.resize(frame.rawSize);
+        uLongf rawSize = frame.rawSize;
+        if (!data || uncompress(reinterpret_cast<Bytef*>(raw.data()),
+                                &rawSize, packed.data(),
+                                frame.packedSize) != Z_OK)
+        {
+            LOG_ERROR("Failed to inflate output frame at {}", frame.rawOffset);
+            current = nullptr;
+            return nullptr;
+        }
+        current = &frame;
+        return current;
+    }
+    size_t read(uint64_t offset, char* buf, size_t len)
+    {
+        size_t copied = 0;
+        while (copied < len)
+        {
+            const Frame* frame = load(offset + copied);
+            if (frame == nullptr)
+            {
+                break;
+            }
+            size_t start = offset + copied - frame->rawOffset;
+            size_t n = std::min(len - copied, frame->rawSize - start);
+            std::memcpy(buf + copied, raw.data() + start, n);
+            copied += n;
+        }
+        return copied;
+    }
+    std::ifstream data;
+    std::vector<Frame> frames;
+    std::vector<char> raw;
+    const Frame* current = nullptr;
+};
+enum class OutputFormat
+{
+    plain,
+    framed,
+    chunked
+};
+// Where a run's output goes: plain <id>.out, framed <id>.outz or chunks
+// listed in <id>.out.manifest
+struct OutputSink
+{
+    OutputSink(const std::string& path, OutputFormat format)
+    {
+        std::error_code ec;
+        // Drop whichever representation a previous run left behind. Older
+        // chunk manifests stay as history.
+        if (format != OutputFormat::plain)
+        {
+            std::filesystem::remove(path, ec);
+        }
+        if (format != OutputFormat::framed)
+        {
+            std::filesystem::remove(path + "z", ec);
+            std::filesystem::remove(path + "z.idx", ec);
+        }
+        if (format != OutputFormat::chunked)
+        {
+            std::filesystem::remove(chunks::manifestPath(path), ec);
+        }
+        switch (format)
+        {
+            case OutputFormat::framed:
+                frames = std::make_unique<FrameWriter>(path + "z");
+                break;
+            case OutputFormat::chunked:
+                chunked = std::make_unique<chunks::ChunkWriter>(path);
+                break;
+            default:
+                raw.open(path, std::ios::binary | std::ios::trunc);
+                break;
+        }
+    }
+    explicit operator bool() const
+    {
+        if (chunked)
+        {
+            return static_cast<bool>(*chunked);
+        }
+        return frames ? static_cast<bool>(*frames) : static_cast<bool>(raw);
+    }
+    void write(const char* buf, size_t size)
+    {
+        if (frames)
+        {
+            frames->write(buf, size);
+            return;
+        }
+        if (chunked)
+        {
+            chunked->write(buf, size);
+            return;
+        }
+        raw.write(buf, static_cast<std::streamsize>(size));
+    }
+    void close()
+    {
+        if (frames)
+        {
+            frames->close();
+            return;
+        }
+        if (chunked)
+        {
+            chunked->close();
+            return;
+        }
+        raw.close();
+    }
+    std::ofstream raw;
+    std::unique_ptr<FrameWriter> frames;
+    std::unique_ptr<chunks::ChunkWriter> chunked;
+};
+// Random access to a run's output whichever way it was stored. A non zero
+// generation reads an earlier run kept in the chunk history.
+struct OutputReader
+{
+    explicit OutputReader(const std::string& path, size_t generation = 0)
+    {
+        auto manifest = chunks::manifestPath(path, generation);
+        if (generation > 0 || std::filesystem::exists(manifest))
+        {
+            chunked = std::make_unique<chunks::ChunkReader>(manifest);
+        }
+        else if (std::filesystem::exists(path + "z"))
+        {
+            frames = std::make_unique<FrameReader>(path + "z");
+        }
+        else
+        {
+            raw.open(path, std::ios::binary);
+        }
+    }
+    explicit operator bool() const
+    {
+        if (chunked)
+        {
+            return static_cast<bool>(*chunked);
+        }
+        return frames ? static_cast<bool>(frames->data)
+                      : static_cast<bool>(raw);
+    }
+    size_t read(uint64_t offset, char* buf, size_t len)
+    {
+        if (frames)
+        {
+            return frames->read(offset, buf, len);
+        }
+        if (chunked)
+        {
+            return chunked->read(offset, buf, len);
+        }
+        raw.clear();
+        raw.seekg(static_cast<std::streamoff>(offset));
+        raw.read(buf, static_cast<std::streamsize>(len));
+        return static_cast<size_t>(raw.gcount());
+    }
+    std::string readLine(uint64_t offset)
+    {
+        std::string line;
+        char buf[256];
+        while (true)
+        {
+            size_t n = read(offset, buf, sizeof(buf));
+            if (n == 0)
+            {
+                break;
+            }
+            auto nl = static_cast<const char*>(std::memchr(buf, '\n', n));
+            if (nl != nullptr)
+            {
+                line.append(buf, static_cast<size_t>(nl - buf));
+                break;
+            }
+            line.append(buf, n);
+            offset += n;
+        }
+        return line;
+    }
+    std::ifstream raw;
+    std::unique_ptr<FrameReader> frames;
+    std::unique_ptr<chunks::ChunkReader> chunked;
+};
+} // namespace scrrunner
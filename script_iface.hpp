@@ -60,6 +60,7 @@ struct ScriptIface
                     return;
                 }
                 LOG_ERROR("Script {} timed out", data.id);
+                getMetrics().runsTimedOut.inc();
                 cancel();
             });
     }
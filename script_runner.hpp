@@ -1,18 +1,34 @@
 #pragma once
+#include "buffer_pool.hpp"
+#include "dbus_interpreter.hpp"
+#include "line_filter.hpp"
 #include "logger.hpp"
+#include "metrics.hpp"
+#include "output_store.hpp"
 #include "sdbus_calls_runner.hpp"
+#include "trace.hpp"
 
 #include <openssl/evp.h>
 
+#include <boost/asio/spawn.hpp>
 #include <boost/process.hpp>
 
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <chrono>
 #include <filesystem>
 #include <fstream>
 #include <functional>
 #include <iostream>
 #include <map>
+#include <memory_resource>
 #include <optional>
 #include <string>
+#include <string_view>
+#include <tuple>
+#include <unordered_set>
+#include <variant>
 #include <vector>
 static constexpr auto acfdirectory = "/tmp/acf";
 namespace bp = boost::process;
@@ -22,6 +38,125 @@ struct ScriptRunner
 {
     using Callback =
         std::function<void(boost::system::error_code, std::string)>;
+    using Environment = std::map<std::string, std::string>;
+    using Match = std::tuple<uint64_t, std::string>;
+    using Range = std::tuple<uint64_t, uint64_t>;
+    enum class ScriptType
+    {
+        bash,
+        dbus
+    };
+    struct ScriptTemplate
+    {
+        std::string id;
+        std::string filename;
+    };
+    // "<id>" or "<id>~<n>" for the n-th earlier chunked run of id
+    struct OutputRef
+    {
+        std::string id;
+        size_t generation = 0;
+    };
+    struct RunOptions
+    {
+        std::vector<std::string> args;
+        Environment env;
+        // Literal patterns; offsets of matching output lines are indexed
+        std::vector<std::string> filter;
+        ScriptType type = ScriptType::bash;
+        // How this run's output is stored; readers handle every format
+        OutputFormat format = OutputFormat::plain;
+    };
+    static std::optional<ScriptType> scriptType(std::string_view name)
+    {
+        if (name == "bash")
+        {
+            return ScriptType::bash;
+        }
+        if (name == "dbus")
+        {
+            return ScriptType::dbus;
+        }
+        return std::nullopt;
+    }
+    static std::optional<OutputFormat> outputFormat(std::string_view name)
+    {
+        if (name == "plain")
+        {
+            return OutputFormat::plain;
+        }
+        if (name == "compressed")
+        {
+            return OutputFormat::framed;
+        }
+        if (name == "deduplicated")
+        {
+            return OutputFormat::chunked;
+        }
+        return std::nullopt;
+    }
+    // Run options as passed over D-Bus (a{sv}): "type" (s), "format" (s)
+    // and "filter" (as). Absent keys keep their defaults.
+    using OptionValue = std::variant<std::string, std::vector<std::string>>;
+    using Options = std::map<std::string, OptionValue>;
+    static std::optional<RunOptions> runOptions(const Options& options)
+    {
+        RunOptions result;
+        for (const auto& [key, value] : options)
+        {
+            const auto* text = std::get_if<std::string>(&value);
+            const auto* list = std::get_if<std::vector<std::string>>(&value);
+            if (key == "type" && text != nullptr)
+            {
+                auto type = scriptType(*text);
+                if (!type)
+                {
+                    LOG_ERROR("Unknown script type: {}", *text);
+                    return std::nullopt;
+                }
+                result.type = *type;
+            }
+            else if (key == "format" && text != nullptr)
+            {
+                auto format = outputFormat(*text);
+                if (!format)
+                {
+                    LOG_ERROR("Unknown output format: {}", *text);
+                    return std::nullopt;
+                }
+                result.format = *format;
+            }
+            else if (key == "filter" && list != nullptr)
+            {
+                result.filter = *list;
+            }
+            else
+            {
+                LOG_ERROR("Invalid run option: {}", key);
+                return std::nullopt;
+            }
+        }
+        return result;
+    }
+    static std::optional<OutputRef> parseRef(std::string_view ref)
+    {
+        auto tilde = ref.find('~');
+        if (tilde == std::string_view::npos)
+        {
+            return OutputRef{std::string(ref), 0};
+        }
+        auto digits = ref.substr(tilde + 1);
+        size_t generation = 0;
+        auto [end, ec] = std::from_chars(
+            digits.data(), digits.data() + digits.size(), generation);
+        if (ec != std::errc{} || end != digits.data() + digits.size() ||
+            generation > chunks::historyDepth)
+        {
+            LOG_ERROR("Invalid output reference: {}", ref);
+            return std::nullopt;
+        }
+        return OutputRef{std::string(ref.substr(0, tilde)), generation};
+    }
     static std::optional<std::string> makeHash(const std::string& script)
     {
         // Create a SHA256 hash of the script string using EVP API
@@ -59,78 +194,320 @@ struct ScriptRunner
         }
         return hash_str;
     }
-    std::string scriptDir(std::string id)
+    std::string scriptDir(const std::string& id)
     {
         std::string dir = std::format("{}/{}", acfdirectory, id);
+        trace::Span span("script_dir", id, trace::blocking);
         if (!std::filesystem::exists(dir))
         {
             std::filesystem::create_directories(dir);
         }
         return dir;
     }
-    std::string scriptFileName(std::string id)
+    // <acfdirectory>/<id>/<id><ext>; unlike scriptDir it never touches the
+    // filesystem, so it is cheap to call on every lookup
+    static std::string runFileName(std::string_view id, std::string_view ext)
+    {
+        std::string_view dir = acfdirectory;
+        std::string name;
+        name.reserve(dir.size() + 2 * id.size() + ext.size() + 2);
+        name.append(dir).append("/").append(id).append("/").append(id).append(
+            ext);
+        return name;
+    }
+    std::string scriptFileName(const std::string& id)
     {
-        return std::format("{}/{}.sh", scriptDir(id), id);
+        scriptDir(id);
+        return runFileName(id, ".sh");
     }
-    std::string scriptOutputFileName(std::string id)
+    static std::string scriptOutputFileName(std::string_view id)
     {
-        return std::format("{}/{}.out", scriptDir(id), id);
+        return runFileName(id, ".out");
     }
-    net::awaitable<boost::system::error_code> writeResult(bp::async_pipe& ap,
-                                                          std::ofstream& os)
+    static std::string scriptMatchFileName(std::string_view id)
     {
-        std::vector<char> buf(4096);
+        return runFileName(id, ".match");
+    }
+    std::string templateFileName(const std::string& name)
+    {
+        return std::format("{}/{}.sh", scriptDir("templates"), name);
+    }
+    static bool isValidTemplateName(const std::string& name)
+    {
+        return !name.empty() &&
+               std::ranges::all_of(name, [](char c) {
+                   return std::isalnum(static_cast<unsigned char>(c)) ||
+                          c == '_' || c == '-';
+               });
+    }
+    static void recordOutput(OutputSink& os, LineFilter& filter,
+                             std::optional<metrics::Clock::time_point>& spawned,
+                             std::string_view id, const char* data, size_t size)
+    {
+        trace::Span span("write_output", id, trace::blocking);
+        if (spawned && size > 0)
+        {
+            getMetrics().firstByte.observe(metrics::Clock::now() - *spawned);
+            spawned.reset();
+        }
+        getMetrics().outputBytes.inc(size);
+        os.write(data, size);
+        filter.feed(data, size);
+    }
+    net::awaitable<boost::system::error_code> writeResult(
+        bp::async_pipe& ap, OutputSink& os,
+        std::optional<metrics::Clock::time_point>& spawned, LineFilter& filter,
+        const std::string& id)
+    {
+        // Take whatever the pipe holds on each wakeup instead of waiting
+        // for a full buffer
+        auto buf = getBufferPool().acquire();
         boost::system::error_code ec{};
         while (!ec)
         {
-            auto size = co_await net::async_read(
-                ap, net::buffer(buf),
+            auto size = co_await ap.async_read_some(
+                net::buffer(buf.data(), buf.size()),
                 net::redirect_error(net::use_awaitable, ec));
             if (ec && ec != net::error::eof)
             {
                 LOG_INFO("Error: {}", ec.message());
                 break;
             }
-            os.write(buf.data(), size);
+            recordOutput(os, filter, spawned, id, buf.data(), size);
         }
         co_return (ec == net::error::eof ? boost::system::error_code{} : ec);
     }
+    // Exit status of a child, filled in by its on_exit handler. Shared
+    // because the handler can outlive the coroutine that spawned the child.
+    struct ExitWait
+    {
+        explicit ExitWait(net::io_context& ioc) :
+            timer(ioc, net::steady_timer::time_point::max())
+        {}
+        std::optional<int> status;
+        net::steady_timer timer;
+    };
+    // Result of a run that got as far as finishing, or nothing if it
+    // failed part way
+    using RunResult = std::optional<boost::system::error_code>;
+    // Every run leaves through here exactly once. A run that fails or
+    // throws part way, e.g. because fork or a write to the output failed,
+    // still gets its callback with an error, so whoever admitted it can
+    // release its slot.
+    net::awaitable<void> complete(const std::string& hash, Callback callback,
+                                  net::awaitable<RunResult> body)
+    {
+        if (!script_cache.emplace(hash, ScriptEntry{[] {}, std::move(callback)})
+                 .second)
+        {
+            LOG_ERROR("Run {} is already active", hash);
+            co_return;
+        }
+        RunResult result;
+        try
+        {
+            result = co_await std::move(body);
+        }
+        catch (const std::exception& e)
+        {
+            LOG_ERROR("Run {} failed: {}", hash, e.what());
+        }
+        if (!result)
+        {
+            invokeCallback(boost::system::errc::make_error_code(
+                               boost::system::errc::io_error),
+                           hash);
+            remove(hash);
+            co_return;
+        }
+        co_await finishRun(hash, *result);
+    }
+    void setTerminate(const std::string& hash, std::function<void()> terminate)
+    {
+        auto it = script_cache.find(hash);
+        if (it != script_cache.end())
+        {
+            it->second.terminate = std::move(terminate);
+        }
+    }
     net::awaitable<void> execute(const std::string& filename,
-                                 const std::string& hash, Callback callback)
+                                 const std::string& hash, RunOptions options,
+                                 Callback callback)
     {
+        co_await complete(hash, std::move(callback),
+                          runProcess(filename, hash, std::move(options)));
+    }
+    net::awaitable<RunResult> runProcess(const std::string& filename,
+                                         const std::string& hash,
+                                         RunOptions options)
+    {
+        trace::Span runSpan("execute", hash);
         bp::async_pipe ap(io_context);
         bp::async_pipe ep(io_context);
 
         boost::system::error_code ec;
-        bp::child c("/usr/bin/bash", filename, bp::std_out > ap,
-                    bp::std_err > ep);
-        // if (ec)
-        // {
-        //     LOG_ERROR("Failed to start child process: {}", ec.message());
-        //     callback(ec, hash);
-        //     co_return;
-        // }
-        script_cache.emplace(hash,
-                             ScriptEntry{std::ref(c), std::move(callback)});
+        trace::Span spawnSpan("spawn", hash);
+        auto launched = metrics::Clock::now();
+        auto& args = options.args;
+        args.insert(args.begin(), filename);
+        bp::environment childEnv = boost::this_process::environment();
+        for (const auto& [key, value] : options.env)
+        {
+            childEnv[key] = value;
+        }
+        auto exited = std::make_shared<ExitWait>(io_context);
+        std::error_code spawnEc;
+        bp::child c(bp::exe = "/usr/bin/bash", bp::args = args, childEnv,
+                    bp::std_out > ap, bp::std_err > ep, io_context,
+                    bp::on_exit = [exited](int status,
+                                           const std::error_code& exitEc) {
+                        exited->status = exitEc ? -1 : status;
+                        exited->timer.cancel();
+                    },
+                    spawnEc);
+        spawnSpan.end();
+        if (spawnEc)
+        {
+            LOG_ERROR("Failed to start child process: {}", spawnEc.message());
+            co_return std::nullopt;
+        }
+        auto spawnedAt = metrics::Clock::now();
+        getMetrics().launchLatency.observe(spawnedAt - launched);
+        getMetrics().runsStarted.inc();
+        std::optional<metrics::Clock::time_point> spawned = spawnedAt;
+        setTerminate(hash, [&c, exited]() {
+            std::error_code ignored;
+            c.terminate(ignored);
+            exited->timer.cancel();
+        });
 
-        std::ofstream ofs(scriptOutputFileName(hash));
-        ec = co_await writeResult(ap, ofs);
+        trace::Span openSpan("open_output", hash);
+        scriptDir(hash);
+        OutputFormat format = options.format;
+        OutputSink ofs(scriptOutputFileName(hash), format);
+        RunArena arena;
+        std::pmr::vector<uint64_t> matches(arena.get());
+        LineFilter filter(std::move(options.filter),
+                          [&matches](uint64_t offset, std::string_view) {
+                              matches.push_back(offset);
+                              return true;
+                          });
+        openSpan.end();
+        trace::Span stdoutSpan("drain_stdout", hash);
+        ec = co_await writeResult(ap, ofs, spawned, filter, hash);
         if (ec)
         {
             LOG_ERROR("{}", ec.message());
-            co_return;
+            co_return std::nullopt;
         }
-        ec = co_await writeResult(ep, ofs);
+        stdoutSpan.end();
+        trace::Span stderrSpan("drain_stderr", hash);
+        ec = co_await writeResult(ep, ofs, spawned, filter, hash);
         if (ec)
         {
             LOG_ERROR("{}", ec.message());
-            co_return;
+            co_return std::nullopt;
+        }
+        {
+            trace::Span span("close_output", hash, trace::blocking);
+            ofs.close();
+            filter.finish();
+            writeMatchIndex(hash, filter.patterns.empty() ? nullptr : &matches);
+        }
+        if (format == OutputFormat::chunked)
+        {
+            sweepChunks(hash);
+        }
+        stderrSpan.end();
+        getMetrics().runDuration.observe(metrics::Clock::now() - spawnedAt);
+        boost::system::error_code result{};
+        if (script_cache.contains(hash) && !exited->status)
+        {
+            // The script may have closed its output and still be running
+            boost::system::error_code waitEc;
+            co_await exited->timer.async_wait(
+                net::redirect_error(net::use_awaitable, waitEc));
         }
-        ofs.close();
+        if (script_cache.contains(hash))
+        {
+            getMetrics().runsFinished.inc();
+            int status = exited->status.value_or(-1);
+            if (status != 0)
+            {
+                LOG_ERROR("Script {} exited with status {}", hash, status);
+                result = boost::system::errc::make_error_code(
+                    boost::system::errc::io_error);
+            }
+        }
+        co_return result;
+    }
+    net::awaitable<void> executeDbus(const std::string& script,
+                                     const std::string& hash,
+                                     RunOptions options, Callback callback)
+    {
+        co_await complete(hash, std::move(callback),
+                          runDbus(script, hash, std::move(options)));
+    }
+    net::awaitable<RunResult> runDbus(const std::string& script,
+                                      const std::string& hash,
+                                      RunOptions options)
+    {
+        trace::Span runSpan("execute", hash);
+        auto startedAt = metrics::Clock::now();
+        getMetrics().runsStarted.inc();
+        std::optional<metrics::Clock::time_point> spawned = startedAt;
+        DbusInterpreter interpreter(*conn, hash);
+        setTerminate(hash, [&interpreter]() { interpreter.cancelled = true; });
+
+        scriptDir(hash);
+        OutputFormat format = options.format;
+        OutputSink ofs(scriptOutputFileName(hash), format);
+        RunArena arena;
+        std::pmr::vector<uint64_t> matches(arena.get());
+        LineFilter filter(std::move(options.filter),
+                          [&matches](uint64_t offset, std::string_view) {
+                              matches.push_back(offset);
+                              return true;
+                          });
+        bool ok = co_await interpreter.execute(
+            script, [&](const std::string& output) {
+                recordOutput(ofs, filter, spawned, hash, output.data(),
+                             output.size());
+            });
+        {
+            trace::Span span("close_output", hash, trace::blocking);
+            ofs.close();
+            filter.finish();
+            writeMatchIndex(hash, filter.patterns.empty() ? nullptr : &matches);
+        }
+        if (format == OutputFormat::chunked)
+        {
+            sweepChunks(hash);
+        }
+        getMetrics().runDuration.observe(metrics::Clock::now() - startedAt);
+        boost::system::error_code result{};
+        if (script_cache.contains(hash))
+        {
+            getMetrics().runsFinished.inc();
+            if (!ok)
+            {
+                LOG_ERROR("D-Bus script {} had failing commands", hash);
+                result = boost::system::errc::make_error_code(
+                    boost::system::errc::io_error);
+            }
+        }
+        co_return result;
+    }
+    net::awaitable<void> finishRun(const std::string& hash,
+                                   boost::system::error_code result)
+    {
+        boost::system::error_code ec;
         uint64_t timeout = 30;
         using paramtype = std::vector<
             std::pair<std::string, std::variant<std::string, uint64_t>>>;
         sdbusplus::message_t msg;
+        getMetrics().dumpCalls.inc();
+        trace::Span dumpSpan("create_dump", hash);
         std::tie(ec, msg) =
             co_await awaitable_dbus_method_call<sdbusplus::message_t>(
                 *conn, "xyz.openbmc_project.Dump.Manager",
@@ -141,7 +518,9 @@ struct ScriptRunner
         {
             LOG_ERROR("Error creating dump: {}", ec.message());
         }
-        invokeCallback(boost::system::error_code{}, hash);
+        dumpSpan.end();
+        trace::Span finishSpan("finish", hash);
+        invokeCallback(result, hash);
         remove(hash);
     }
     void invokeCallback(boost::system::error_code ec, const std::string& id)
@@ -160,6 +539,29 @@ struct ScriptRunner
     bool run_script(const std::string& id, const std::string& script,
                     Callback callback)
     {
+        return run_script(id, script, std::move(callback), RunOptions{});
+    }
+    bool run_script(const std::string& id, const std::string& script,
+                    Callback callback, RunOptions options)
+    {
+        if (options.type == ScriptType::dbus)
+        {
+            // Interpreted in process; there is no script file to write
+            net::co_spawn(
+                io_context,
+                [this, script = script, id = id, callback = std::move(callback),
+                 options = std::move(options),
+                 queued = metrics::Clock::now()]() mutable
+                -> net::awaitable<void> {
+                    getMetrics().queueWait.observe(metrics::Clock::now() -
+                                                   queued);
+                    co_await executeDbus(script, id, std::move(options),
+                                         std::move(callback));
+                },
+                net::detached);
+            return true;
+        }
+        trace::Span span("write_script", id, trace::blocking);
         auto filename = scriptFileName(id);
         // Write the script to a file
         std::ofstream script_file(filename);
@@ -170,16 +572,286 @@ struct ScriptRunner
         }
         script_file << script;
         script_file.close();
+        span.end();
 
         net::co_spawn(
             io_context,
-            [this, filename, id = id,
-             callback = std::move(callback)]() mutable -> net::awaitable<void> {
-                co_await execute(filename, id, std::move(callback));
+            [this, filename, id = id, callback = std::move(callback),
+             options = std::move(options),
+             queued = metrics::Clock::now()]() mutable -> net::awaitable<void> {
+                getMetrics().queueWait.observe(metrics::Clock::now() - queued);
+                co_await execute(filename, id, std::move(options),
+                                 std::move(callback));
             },
             net::detached);
         return true;
     }
+    bool register_template(boost::asio::yield_context yield,
+                           const std::string& name, const std::string& script)
+    {
+        if (!isValidTemplateName(name))
+        {
+            LOG_ERROR("Invalid template name: {}", name);
+            return false;
+        }
+        auto id = makeHash(script);
+        if (!id)
+        {
+            LOG_ERROR("Failed to create template hash");
+            return false;
+        }
+        auto it = templates.find(name);
+        if (it != templates.end() && it->second.id == *id)
+        {
+            return true;
+        }
+        auto filename = templateFileName(name);
+        // bash reads scripts lazily, so runs of the current body must never
+        // see the file change under them: stage the new body and rename it
+        // into place only once it has passed validation
+        auto staged = std::format("{}.{}.tmp", filename, ++stagedTemplates);
+        {
+            trace::Span span("register_template", *id, trace::blocking);
+            std::ofstream template_file(staged);
+            if (!template_file)
+            {
+                LOG_ERROR("Failed to create template file: {}", staged);
+                return false;
+            }
+            template_file << script;
+        }
+
+        // Syntax check once here so that runs never have to
+        boost::system::error_code ec;
+        int status = bp::async_system(
+            io_context, yield[ec], bp::exe = "/usr/bin/bash",
+            bp::args = {"-n", staged}, bp::std_out > bp::null,
+            bp::std_err > bp::null);
+        std::error_code fsEc;
+        if (ec || status != 0)
+        {
+            LOG_ERROR("Template {} failed validation", name);
+            std::filesystem::remove(staged, fsEc);
+            return false;
+        }
+        std::filesystem::rename(staged, filename, fsEc);
+        if (fsEc)
+        {
+            LOG_ERROR("Failed to install template {}: {}", name,
+                      fsEc.message());
+            std::filesystem::remove(staged, fsEc);
+            return false;
+        }
+        templates.insert_or_assign(name, ScriptTemplate{*id, filename});
+        return true;
+    }
+    std::optional<std::string> templateRunId(
+        const std::string& name, const std::vector<std::string>& args,
+        const Environment& env)
+    {
+        auto it = templates.find(name);
+        if (it == templates.end())
+        {
+            LOG_ERROR("Unknown template: {}", name);
+            return std::nullopt;
+        }
+        std::string key = it->second.id;
+        for (const auto& arg : args)
+        {
+            key.push_back('\0');
+            key += arg;
+        }
+        for (const auto& [k, v] : env)
+        {
+            key.push_back('\0');
+            key += std::format("{}={}", k, v);
+        }
+        return makeHash(key);
+    }
+    bool run_template(const std::string& name, const std::string& id,
+                      RunOptions options, Callback callback)
+    {
+        auto it = templates.find(name);
+        if (it == templates.end())
+        {
+            LOG_ERROR("Unknown template: {}", name);
+            return false;
+        }
+        net::co_spawn(
+            io_context,
+            [this, filename = it->second.filename, id = id,
+             options = std::move(options), callback = std::move(callback),
+             queued = metrics::Clock::now()]() mutable -> net::awaitable<void> {
+                getMetrics().queueWait.observe(metrics::Clock::now() - queued);
+                co_await execute(filename, id, std::move(options),
+                                 std::move(callback));
+            },
+            net::detached);
+        return true;
+    }
+    void writeMatchIndex(const std::string& id,
+                         const std::pmr::vector<uint64_t>* matches)
+    {
+        auto filename = scriptMatchFileName(id);
+        if (matches == nullptr)
+        {
+            // Never leave a stale index from an earlier filtered run
+            std::error_code ec;
+            std::filesystem::remove(filename, ec);
+            return;
+        }
+        std::ofstream ofs(filename, std::ios::trunc);
+        for (auto offset : *matches)
+        {
+            ofs << offset << '\n';
+        }
+    }
+    void sweepChunks(const std::string& id)
+    {
+        auto now = std::chrono::steady_clock::now();
+        if (lastSweep && now - *lastSweep < chunks::sweepInterval)
+        {
+            return;
+        }
+        lastSweep = now;
+        trace::Span span("sweep_chunks", id, trace::blocking);
+        chunks::sweep(acfdirectory);
+    }
+    // The chunk list of a deduplicated run's output. Other formats have
+    // none; chunking them here would hash the whole output on the io thread.
+    std::optional<chunks::Manifest> manifestOf(const std::string& id)
+    {
+        auto ref = parseRef(id);
+        if (!ref)
+        {
+            return std::nullopt;
+        }
+        auto manifest = chunks::loadManifest(chunks::manifestPath(
+            scriptOutputFileName(ref->id), ref->generation));
+        if (!manifest)
+        {
+            LOG_ERROR("Output of {} is not stored deduplicated", id);
+        }
+        return manifest;
+    }
+    // Byte ranges of other's output whose content does not occur anywhere
+    // in base's, found by comparing chunk lists instead of bytes. Both runs
+    // must be stored deduplicated.
+    std::optional<std::vector<Range>> diff(const std::string& base,
+                                           const std::string& other)
+    {
+        trace::Span span("diff", other, trace::blocking);
+        auto before = manifestOf(base);
+        auto after = manifestOf(other);
+        if (!before || !after)
+        {
+            return std::nullopt;
+        }
+        std::vector<Range> changed;
+        std::unordered_set<std::string_view> known;
+        for (const auto& ref : *before)
+        {
+            known.insert(ref.hash);
+        }
+        uint64_t offset = 0;
+        for (const auto& ref : *after)
+        {
+            if (!known.contains(ref.hash))
+            {
+                auto* last = changed.empty() ? nullptr : &changed.back();
+                if (last != nullptr &&
+                    std::get<0>(*last) + std::get<1>(*last) == offset)
+                {
+                    std::get<1>(*last) += ref.size;
+                }
+                else
+                {
+                    changed.emplace_back(offset, ref.size);
+                }
+            }
+            offset += ref.size;
+        }
+        return changed;
+    }
+    // Returns up to maxMatches lines at or after byte offset 'offset' of the
+    // run output containing any of the patterns. With no patterns, returns
+    // the lines recorded by the filter the run was started with.
+    std::vector<Match> grep(const std::string& id,
+                            std::vector<std::string> patterns,
+                            uint64_t maxMatches, uint64_t offset)
+    {
+        trace::Span span("grep", id, trace::blocking);
+        std::vector<Match> result;
+        auto ref = parseRef(id);
+        if (!ref)
+        {
+            return result;
+        }
+        OutputReader reader(scriptOutputFileName(ref->id), ref->generation);
+        if (!reader || maxMatches == 0)
+        {
+            return result;
+        }
+        if (patterns.empty())
+        {
+            // The match index only describes the latest run
+            if (ref->generation > 0)
+            {
+                return result;
+            }
+            std::ifstream index(scriptMatchFileName(ref->id));
+            uint64_t lineOffset = 0;
+            while (result.size() < maxMatches && index >> lineOffset)
+            {
+                if (lineOffset >= offset)
+                {
+                    result.emplace_back(lineOffset,
+                                        reader.readLine(lineOffset));
+                }
+            }
+            return result;
+        }
+        LineFilter filter(std::move(patterns),
+                          [&](uint64_t lineOffset, std::string_view line) {
+                              result.emplace_back(offset + lineOffset,
+                                                  std::string(line));
+                              return result.size() < maxMatches;
+                          });
+        auto buf = getBufferPool().acquire();
+        uint64_t pos = offset;
+        while (filter.active())
+        {
+            size_t n = reader.read(pos, buf.data(), buf.size());
+            if (n == 0)
+            {
+                break;
+            }
+            filter.feed(buf.data(), n);
+            pos += n;
+        }
+        filter.finish();
+        return result;
+    }
+    std::vector<uint8_t> read(const std::string& id, uint64_t offset,
+                              uint64_t len)
+    {
+        trace::Span span("read", id, trace::blocking);
+        constexpr uint64_t maxRead = 1024 * 1024;
+        std::vector<uint8_t> result(std::min(len, maxRead));
+        auto ref = parseRef(id);
+        if (!ref)
+        {
+            return {};
+        }
+        OutputReader reader(scriptOutputFileName(ref->id), ref->generation);
+        if (!reader)
+        {
+            return {};
+        }
+        result.resize(reader.read(
+            offset, reinterpret_cast<char*>(result.data()), result.size()));
+        return result;
+    }
     bool cancel_script(const std::string& id)
     {
         auto it = script_cache.find(id);
@@ -187,8 +859,9 @@ struct ScriptRunner
         {
             return false;
         }
-        it->second.child.get().terminate();
-        it->second.callback(boost::system::error_code{}, id);
+        it->second.terminate();
+        getMetrics().runsCancelled.inc();
+        it->second.callback(net::error::operation_aborted, id);
         remove(id);
         return true;
     }
@@ -201,7 +874,7 @@ struct ScriptRunner
         while (!script_cache.empty())
         {
             auto p = *script_cache.begin();
-            p.second.child.get().terminate();
+            p.second.terminate();
             remove(p.first);
         }
     }
@@ -209,9 +882,12 @@ struct ScriptRunner
     std::shared_ptr<sdbusplus::asio::connection> conn;
     struct ScriptEntry
     {
-        std::reference_wrapper<bp::child> child;
+        std::function<void()> terminate;
         std::function<void(boost::system::error_code, std::string)> callback;
     };
     std::map<std::string, ScriptEntry> script_cache;
+    std::map<std::string, ScriptTemplate> templates;
+    uint64_t stagedTemplates = 0;
+    std::optional<std::chrono::steady_clock::time_point> lastSweep;
 };
 } // namespace scrrunner
@@ -30,6 +30,19 @@ inline auto awaitable_dbus_method_call(
     co_return co_await h();
 }
 
+inline AwaitableResult<sdbusplus::message_t> awaitable_dbus_send(
+    sdbusplus::asio::connection& conn, sdbusplus::message_t& msg)
+{
+    auto h = make_awaitable_handler<sdbusplus::message_t>([&](auto promise) {
+        conn.async_send(msg, [promise = std::move(promise)](
+                                 boost::system::error_code ec,
+                                 sdbusplus::message_t& reply) mutable {
+            promise.setValues(ec, std::move(reply));
+        });
+    });
+    co_return co_await h();
+}
+
 template <typename Type>
 inline AwaitableResult<Type> getProperty(
     sdbusplus::asio::connection& conn, const std::string& service,
@@ -0,0 +1,109 @@
+#pragma once
+#include "logger.hpp"
+#include "make_awaitable_runner.hpp"
+#include "metrics.hpp"
+#include "trace.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <stop_token>
+#include <thread>
+namespace scrrunner
+{
+namespace stall
+{
+using Clock = trace::Clock;
+constexpr auto heartbeat = std::chrono::milliseconds(50);
+} // namespace stall
+
+// Heartbeat on the io thread feeds the loop lag histogram; a watchdog
+// thread reports a stall while it is still happening, naming the
+// blocking trace::Span that holds the loop.
+struct StallDetector
+{
+    explicit StallDetector(net::io_context& ioc) :
+        heartbeatTimer(ioc),
+        watchdog([this](std::stop_token stop) { watch(stop); })
+    {
+        beat();
+        startHeartbeat();
+    }
+    ~StallDetector()
+    {
+        heartbeatTimer.cancel();
+        watchdog.request_stop();
+        wakeup.notify_all();
+    }
+    void beat()
+    {
+        lastBeat.store(stall::Clock::now().time_since_epoch().count(),
+                       std::memory_order_relaxed);
+    }
+    void startHeartbeat()
+    {
+        heartbeatTimer.expires_after(stall::heartbeat);
+        heartbeatTimer.async_wait([this](const boost::system::error_code& ec) {
+            if (ec)
+            {
+                return;
+            }
+            // Time between the deadline and the handler actually running
+            getMetrics().loopLag.observe(stall::Clock::now() -
+                                         heartbeatTimer.expiry());
+            beat();
+            startHeartbeat();
+        });
+    }
+    void watch(std::stop_token stop)
+    {
+        using std::chrono::duration_cast;
+        using std::chrono::milliseconds;
+        auto& s = trace::loopState();
+        bool reported = false;
+        std::mutex mutex;
+        std::unique_lock lock(mutex);
+        while (!stop.stop_requested())
+        {
+            wakeup.wait_for(lock, stop, trace::stallThreshold,
+                            [] { return false; });
+            if (stop.stop_requested())
+            {
+                break;
+            }
+            auto now = stall::Clock::now();
+            auto beatAt = stall::Clock::time_point(stall::Clock::duration(
+                lastBeat.load(std::memory_order_relaxed)));
+            auto silent = now - beatAt;
+            if (silent < stall::heartbeat + trace::stallThreshold)
+            {
+                reported = false;
+                continue;
+            }
+            if (reported)
+            {
+                continue;
+            }
+            reported = true;
+            const char* op = s.op.load(std::memory_order_relaxed);
+            if (op == nullptr)
+            {
+                LOG_WARNING("Event loop stalled for {}ms outside any "
+                            "instrumented operation",
+                            duration_cast<milliseconds>(silent).count());
+                continue;
+            }
+            auto since = stall::Clock::time_point(stall::Clock::duration(
+                s.since.load(std::memory_order_relaxed)));
+            LOG_WARNING("Event loop stalled: {} (run {:016x}) running for {}ms",
+                        op, s.tag.load(std::memory_order_relaxed),
+                        duration_cast<milliseconds>(now - since).count());
+        }
+    }
+    boost::asio::steady_timer heartbeatTimer;
+    std::condition_variable_any wakeup;
+    std::atomic<stall::Clock::rep> lastBeat{0};
+    std::jthread watchdog;
+};
+} // namespace scrrunner
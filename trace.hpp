@@ -0,0 +1,242 @@
+#pragma once
+#include "logger.hpp"
+#include "metrics.hpp"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <format>
+#include <map>
+#include <string>
+#include <string_view>
+namespace scrrunner
+{
+namespace trace
+{
+using Clock = std::chrono::steady_clock;
+struct Event
+{
+    const char* name = nullptr;
+    std::array<char, 32> tag{};
+    uint8_t tagLen = 0;
+    int64_t beginNs = 0;
+    int64_t endNs = 0;
+    std::string_view tagView() const
+    {
+        return {tag.data(), tagLen};
+    }
+};
+// Fixed size ring of completed spans. Recording copies a few words into the
+// next slot; nothing is allocated and old spans are simply overwritten.
+struct Buffer
+{
+    static constexpr size_t capacity = 4096;
+    void record(const char* name, std::string_view tag, int64_t beginNs,
+                int64_t endNs)
+    {
+        auto& event =
+            events[next.fetch_add(1, std::memory_order_relaxed) % capacity];
+        event.name = name;
+        event.tagLen =
+            static_cast<uint8_t>(std::min(tag.size(), event.tag.size()));
+        std::copy_n(tag.data(), event.tagLen, event.tag.data());
+        event.beginNs = beginNs;
+        event.endNs = endNs;
+    }
+    static std::string escape(std::string_view in)
+    {
+        std::string out;
+        for (char c : in)
+        {
+            if (c == '"' || c == '\\')
+            {
+                out.push_back('\\');
+            }
+            if (static_cast<unsigned char>(c) >= 0x20)
+            {
+                out.push_back(c);
+            }
+        }
+        return out;
+    }
+    // Chrome trace event format, loadable by chrome://tracing and Perfetto.
+    // Each distinct tag (a run id, or run id/lane for D-Bus commands) gets
+    // its own track.
+    std::string toChromeJson() const
+    {
+        size_t end = next.load(std::memory_order_relaxed);
+        size_t begin = end > capacity ? end - capacity : 0;
+        std::map<std::string, int, std::less<>> tracks;
+        std::string out = "{\"traceEvents\":[";
+        bool first = true;
+        for (size_t i = begin; i < end; ++i)
+        {
+            const auto& event = events[i % capacity];
+            if (event.name == nullptr)
+            {
+                continue;
+            }
+            auto tag = event.tagView();
+            auto track = tracks.find(tag);
+            if (track == tracks.end())
+            {
+                track = tracks.emplace(std::string(tag), tracks.size() + 1)
+                            .first;
+            }
+            out += std::format(
+                "{}{{\"name\":\"{}\",\"cat\":\"acfshell\",\"ph\":\"X\","
+                "\"ts\":{:.3f},\"dur\":{:.3f},\"pid\":{},\"tid\":{},"
+                "\"args\":{{\"tag\":\"{}\"}}}}",
+                first ? "" : ",", event.name, event.beginNs / 1e3,
+                (event.endNs - event.beginNs) / 1e3, getpid(), track->second,
+                escape(tag));
+            first = false;
+        }
+        for (const auto& [tag, tid] : tracks)
+        {
+            out += std::format(
+                "{}{{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":{},"
+                "\"tid\":{},\"args\":{{\"name\":\"{}\"}}}}",
+                first ? "" : ",", getpid(), tid, escape(tag));
+            first = false;
+        }
+        out += "]}";
+        return out;
+    }
+    void clear()
+    {
+        events.fill(Event{});
+        next.store(0, std::memory_order_relaxed);
+    }
+    std::array<Event, capacity> events{};
+    std::atomic<size_t> next{0};
+};
+inline std::atomic<bool>& enabled()
+{
+    static std::atomic<bool> flag{false};
+    return flag;
+}
+inline Buffer& buffer()
+{
+    static Buffer buf;
+    return buf;
+}
+inline int64_t toNs(Clock::time_point t)
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               t.time_since_epoch())
+        .count();
+}
+// A blocking span holding the io thread longer than this is a stall
+constexpr auto stallThreshold = std::chrono::milliseconds(100);
+// The blocking span the io thread is in right now, read by the stall
+// watchdog. Only the io thread writes it, so plain relaxed loads and
+// stores are enough.
+struct LoopState
+{
+    std::atomic<const char*> op{nullptr};
+    std::atomic<uint64_t> tag{0};
+    std::atomic<Clock::rep> since{0};
+};
+inline LoopState& loopState()
+{
+    static LoopState s;
+    return s;
+}
+// Run ids are 16 hex digits, so they pack losslessly into 64 bits
+inline uint64_t packTag(std::string_view id)
+{
+    uint64_t tag = 0;
+    std::from_chars(id.data(), id.data() + std::min<size_t>(id.size(), 16),
+                    tag, 16);
+    return tag;
+}
+struct Blocking
+{};
+inline constexpr Blocking blocking{};
+// RAII span. When tracing is off this is one relaxed load in the
+// constructor and a branch in the destructor.
+//
+// A span constructed with 'blocking' marks a section that never suspends:
+// it also tells the stall watchdog what holds the io thread and reports
+// itself if it held it past stallThreshold. Such spans read the clock
+// whether or not tracing is on.
+struct Span
+{
+    Span(const char* name, std::string_view tag) :
+        name(enabled().load(std::memory_order_relaxed) ? name : nullptr),
+        tag(tag)
+    {
+        if (this->name != nullptr)
+        {
+            begin = Clock::now();
+        }
+    }
+    Span(const char* name, std::string_view tag, Blocking) :
+        Span(name, tag)
+    {
+        auto& state = loopState();
+        op = name;
+        if (this->name == nullptr)
+        {
+            begin = Clock::now();
+        }
+        prevOp = state.op.load(std::memory_order_relaxed);
+        prevTag = state.tag.load(std::memory_order_relaxed);
+        prevSince = state.since.load(std::memory_order_relaxed);
+        state.op.store(op, std::memory_order_relaxed);
+        state.tag.store(packTag(tag), std::memory_order_relaxed);
+        state.since.store(begin.time_since_epoch().count(),
+                          std::memory_order_relaxed);
+    }
+    Span(const Span&) = delete;
+    Span& operator=(const Span&) = delete;
+    ~Span()
+    {
+        end();
+    }
+    void end()
+    {
+        if (name == nullptr && op == nullptr)
+        {
+            return;
+        }
+        auto now = Clock::now();
+        if (name != nullptr)
+        {
+            buffer().record(name, tag, toNs(begin), toNs(now));
+            name = nullptr;
+        }
+        if (op != nullptr)
+        {
+            auto& state = loopState();
+            state.op.store(prevOp, std::memory_order_relaxed);
+            state.tag.store(prevTag, std::memory_order_relaxed);
+            state.since.store(prevSince, std::memory_order_relaxed);
+            if (now - begin > stallThreshold)
+            {
+                getMetrics().stalls.inc();
+                LOG_WARNING("Event loop blocked for {}ms in {} (run {})",
+                            std::chrono::duration_cast<
+                                std::chrono::milliseconds>(now - begin)
+                                .count(),
+                            op, tag);
+            }
+            op = nullptr;
+        }
+    }
+    const char* name;
+    std::string_view tag;
+    Clock::time_point begin;
+    const char* op = nullptr;
+    const char* prevOp = nullptr;
+    uint64_t prevTag = 0;
+    Clock::rep prevSince = 0;
+};
+} // namespace trace
+} // namespace scrrunner